@@ -0,0 +1,189 @@
+/*
+ * fawrap-apply - Write blocks marked in a delta file (fawrap.so
+ *          option dirty) into another copy of the base image, so
+ *          an update costs only as much as was changed. Blocks come
+ *          from the delta itself when it was written with data, or
+ *          from the updated image given with -s.
+ *
+ * Usage:
+ *   fawrap-apply [-n] [-s new.img[,offset]] delta target[,offset]
+ *
+ *   fawrap-apply root.delta /dev/mmcblk0,44040192
+ *   fawrap-apply -s disk.img,44040192 root.delta old.img,44040192
+ *
+ * Copyright (C) 2016 Peter Vicman <peter.vicman(at)gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _LARGEFILE64_SOURCE
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "fawrap-delta.h"
+
+#define RUN (1 << 20)      /* blocks copied at once */
+
+static bool dry_run = false;
+
+static void usage(void) {
+  fprintf(stderr, "usage: fawrap-apply [-n] [-s new.img[,offset]] delta target[,offset]\n" \
+    "  -n  dry run, only report what would be written\n" \
+    "  -s  take blocks from updated image (delta without data)\n");
+  exit(2);
+}
+
+static void fail(const char *name) {
+  fprintf(stderr, "fawrap-apply: %s: %s\n", name, errno != 0 ? strerror(errno) : "bad delta");
+  exit(1);
+}
+
+/* name[,offset], name is cut off spec */
+static off64_t parse_spec(char *spec) {
+char *p = strchr(spec, ',');
+
+  if (p == NULL)
+    return 0;
+
+  *p++ = '\0';
+  return strtoull(p, NULL, 10);
+}
+
+static bool read_all(int fd, void *buf, size_t len, off64_t offset) {
+ssize_t res = pread64(fd, buf, len, offset);
+
+  if (res != (ssize_t) len) {
+    errno = res < 0 ? errno : 0;
+    return true;
+  }
+
+  return false;
+}
+
+int main(int argc, char *argv[]) {
+struct delta_hdr hdr;
+char *source = NULL, *delta, *target;
+off64_t source_offset = 0, target_offset, pos, len;
+unsigned long long runs = 0, bytes = 0;
+uint64_t *bits, block, start;
+int fd, src = -1, out;
+ssize_t res;
+char *buf;
+int opt;
+
+  while ((opt = getopt(argc, argv, "ns:")) != -1) {
+    switch (opt) {
+    case 'n':
+      dry_run = true;
+      break;
+    case 's':
+      source = optarg;
+      source_offset = parse_spec(source);
+      break;
+    default:
+      usage();
+    }
+  }
+
+  if (argc - optind != 2)
+    usage();
+  delta = argv[optind];
+  target = argv[optind + 1];
+  target_offset = parse_spec(target);
+
+  fd = open64(delta, O_RDONLY);
+  if (fd < 0)
+    fail(delta);
+
+  errno = 0;
+  if (read_all(fd, &hdr, sizeof(hdr), 0) || \
+      memcmp(hdr.magic, DELTA_MAGIC, sizeof(hdr.magic)) != 0 || \
+      hdr.version != DELTA_VERSION || hdr.block_size == 0 || RUN % hdr.block_size != 0 || \
+      hdr.blocks != (hdr.segment_len + hdr.block_size - 1) / hdr.block_size)
+    fail(delta);
+
+  /* blocks come from somewhere */
+  if (! (hdr.flags & DELTA_DATA) && source == NULL) {
+    fprintf(stderr, "fawrap-apply: %s has no data, updated image needed (-s)\n", delta);
+    return 1;
+  }
+
+  bits = malloc(delta_words(hdr.blocks) * sizeof(*bits));
+  buf = malloc(RUN);
+  if (bits == NULL || buf == NULL || \
+      read_all(fd, bits, delta_words(hdr.blocks) * sizeof(*bits), sizeof(hdr)))
+    fail(delta);
+
+  if (source != NULL && (src = open64(source, O_RDONLY)) < 0)
+    fail(source);
+
+  out = open64(target, dry_run ? O_RDONLY : O_WRONLY);
+  if (out < 0)
+    fail(target);
+
+  /* data of delta follows bitmap, in block order */
+  pos = sizeof(hdr) + delta_words(hdr.blocks) * sizeof(*bits);
+
+  for (block = 0; block < hdr.blocks; ) {
+    if (! (bits[block / 64] & (1ULL << (block % 64)))) {
+      block++;
+      continue;
+    }
+
+    start = block;
+    while (block < hdr.blocks && bits[block / 64] & (1ULL << (block % 64)) && \
+        (block - start) * hdr.block_size < RUN)
+      block++;
+
+    len = block * hdr.block_size < hdr.segment_len ? block * hdr.block_size : hdr.segment_len;
+    len -= start * hdr.block_size;
+    runs++;
+    bytes += len;
+    if (dry_run)
+      continue;
+
+    errno = 0;
+    if (src >= 0) {
+      if (read_all(src, buf, len, source_offset + start * hdr.block_size))
+        fail(source);
+    } else if (read_all(fd, buf, len, pos))
+      fail(delta);
+    pos += len;
+
+    res = pwrite64(out, buf, len, target_offset + start * hdr.block_size);
+    if (res != len) {
+      errno = res < 0 ? errno : ENOSPC;
+      fail(target);
+    }
+  }
+
+  if (! dry_run && fsync(out) != 0)
+    fail(target);
+
+  printf("%s %llu of %llu blocks (%llu bytes) in %llu writes\n", \
+    dry_run ? "would write" : "wrote", (unsigned long long) hdr.changed, \
+    (unsigned long long) hdr.blocks, bytes, runs);
+
+  close(out);
+  close(fd);
+  return 0;
+}
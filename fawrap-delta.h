@@ -0,0 +1,56 @@
+/*
+ * fawrap-delta.h - Delta file written by fawrap.so (option dirty)
+ *          and applied by fawrap-apply.
+ *
+ * Layout:
+ *   struct delta_hdr
+ *   bitmap of changed blocks, (blocks + 63) / 64 uint64_t words,
+ *     bit b of word w is block w * 64 + b
+ *   with DELTA_DATA: contents of changed blocks in block order,
+ *     last block of segment may be short
+ *
+ * Fields are in host byte order, like the overlay delta.
+ *
+ * Copyright (C) 2016 Peter Vicman <peter.vicman(at)gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FAWRAP_DELTA_H
+#define FAWRAP_DELTA_H
+
+#include <stdint.h>
+
+#define DELTA_MAGIC "FAWRAPDL"
+#define DELTA_VERSION 1
+#define DELTA_BLOCK 4096
+
+#define DELTA_DATA 0x1     /* block contents follow bitmap */
+
+struct delta_hdr {
+  char magic[8];
+  uint32_t version;
+  uint32_t block_size;
+  uint64_t segment_len;
+  uint64_t blocks;        /* bits in bitmap */
+  uint64_t changed;       /* bits set */
+  uint32_t flags;
+  uint32_t reserved;
+};
+
+static inline uint64_t delta_words(uint64_t blocks) {
+  return (blocks + 63) / 64;
+}
+
+#endif
@@ -0,0 +1,271 @@
+/*
+ * fawrap-sparsify - Punch holes in zero filled blocks of a segment
+ *          of a file, usually a partition inside a finished disk
+ *          image. Segment is given the same way as to fawrap.so.
+ *
+ * Usage:
+ *   fawrap-sparsify [-n] [-b block] [-t threads] [file.img,offset,length]
+ *
+ *   FILE=disk.img,44040192,33554944 fawrap-sparsify -n
+ *   fawrap-sparsify disk.img,44040192,33554944
+ *
+ * Copyright (C) 2016 Peter Vicman <peter.vicman(at)gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _LARGEFILE64_SOURCE
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <linux/falloc.h>
+#include <pthread.h>
+
+#define CHUNK (4 << 20)      /* scanned by one thread at a time */
+#define MAX_THREADS 64
+
+/* 32 bytes at once, compiler picks SSE2, AVX2, NEON, ... */
+typedef uint64_t vec_t __attribute__((vector_size(32), aligned(32)));
+
+static char *file_name;
+static off64_t segment_offset;
+static off64_t segment_len;
+static off64_t block_size = 0;   /* 0 - block size of filesystem */
+static bool dry_run = false;
+static int threads = 0;          /* 0 - number of cpus, max 8 */
+
+static int fd;
+static off64_t scan_start, scan_end;   /* block aligned part of segment */
+static off64_t next_chunk;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long long bytes_scanned = 0;
+static unsigned long long bytes_zero = 0;
+static unsigned long long bytes_holes = 0;
+static int error = 0;
+
+/* block is aligned and a multiple of 4 vectors */
+static bool block_zero(const char *buf, size_t len) {
+const vec_t *v = (const vec_t *) buf;
+vec_t acc = { 0 };
+size_t i;
+
+  for (i = 0; i < len / sizeof(vec_t); i += 4) {
+    acc |= v[i] | v[i + 1] | v[i + 2] | v[i + 3];
+    if (acc[0] | acc[1] | acc[2] | acc[3])
+      return false;
+  }
+
+  return true;
+}
+
+static void punch(off64_t start, off64_t len) {
+  __atomic_fetch_add(&bytes_zero, len, __ATOMIC_RELAXED);
+
+  if (! dry_run && \
+      fallocate64(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, len) != 0)
+    __atomic_store_n(&error, errno, __ATOMIC_RELAXED);
+}
+
+/* data part of a chunk, holes are skipped without reading */
+static void scan_data(char *buf, off64_t start, off64_t end) {
+off64_t pos, run = -1;
+ssize_t res;
+size_t i;
+
+  res = pread64(fd, buf, end - start, start);
+  if (res != end - start) {
+    __atomic_store_n(&error, res < 0 ? errno : EIO, __ATOMIC_RELAXED);
+    return;
+  }
+  __atomic_fetch_add(&bytes_scanned, res, __ATOMIC_RELAXED);
+
+  for (i = 0; i < (size_t) res; i += block_size) {
+    pos = start + i;
+    if (block_zero(buf + i, block_size)) {
+      if (run < 0)
+        run = pos;
+    } else if (run >= 0) {
+      punch(run, pos - run);
+      run = -1;
+    }
+  }
+
+  if (run >= 0)
+    punch(run, end - run);
+}
+
+static void scan_chunk(char *buf, off64_t start, off64_t end) {
+off64_t pos, data, hole;
+
+  for (pos = start; pos < end; pos = hole) {
+    data = lseek64(fd, pos, SEEK_DATA);
+    if (data < 0 || data >= end)
+      data = end;
+    else
+      data -= (data - scan_start) % block_size;
+
+    /* holes found on the way */
+    __atomic_fetch_add(&bytes_holes, data - pos, __ATOMIC_RELAXED);
+    if (data == end)
+      break;
+
+    hole = lseek64(fd, data, SEEK_HOLE);
+    if (hole < 0 || hole > end)
+      hole = end;
+    else
+      hole += (block_size - (hole - scan_start) % block_size) % block_size;
+    if (hole > end)
+      hole = end;
+
+    scan_data(buf, data, hole);
+  }
+}
+
+static void *worker(void *arg) {
+char *buf;
+off64_t start;
+
+  if (posix_memalign((void **) &buf, 4096, CHUNK) != 0) {
+    __atomic_store_n(&error, ENOMEM, __ATOMIC_RELAXED);
+    return NULL;
+  }
+
+  for (;;) {
+    pthread_mutex_lock(&lock);
+    start = next_chunk;
+    next_chunk += CHUNK;
+    pthread_mutex_unlock(&lock);
+
+    if (start >= scan_end || __atomic_load_n(&error, __ATOMIC_RELAXED))
+      break;
+
+    scan_chunk(buf, start, start + CHUNK < scan_end ? start + CHUNK : scan_end);
+  }
+
+  free(buf);
+  return NULL;
+}
+
+static void usage(void) {
+  fprintf(stderr, "usage: fawrap-sparsify [-n] [-b block] [-t threads] " \
+    "[file.img,offset,length]\n" \
+    "  -n  dry run, only report reclaimable bytes\n" \
+    "  -b  hole granularity (default block size of filesystem)\n" \
+    "  -t  threads (default cpus, max 8)\n" \
+    "  segment is taken from FILE if not given\n");
+  exit(2);
+}
+
+/* name,offset,length like FILE of fawrap.so */
+static bool parse_segment(char *spec) {
+char *p;
+
+  file_name = strtok(spec, ",");
+  p = strtok(NULL, ",");
+  if (file_name == NULL || p == NULL)
+    return true;
+  segment_offset = strtoull(p, NULL, 10);
+
+  p = strtok(NULL, ",");
+  if (p == NULL)
+    return true;
+  segment_len = strtoull(p, NULL, 10);
+
+  return false;
+}
+
+int main(int argc, char *argv[]) {
+pthread_t tid[MAX_THREADS];
+struct stat64 st;
+char *spec;
+long cpus;
+int opt, i;
+
+  while ((opt = getopt(argc, argv, "nb:t:")) != -1) {
+    switch (opt) {
+    case 'n':
+      dry_run = true;
+      break;
+    case 'b':
+      block_size = strtoull(optarg, NULL, 10);
+      if (block_size < 512 || block_size % (4 * sizeof(vec_t)) != 0 || CHUNK % block_size != 0)
+        usage();
+      break;
+    case 't':
+      threads = atoi(optarg);
+      if (threads < 1 || threads > MAX_THREADS)
+        usage();
+      break;
+    default:
+      usage();
+    }
+  }
+
+  spec = optind < argc ? argv[optind] : getenv("FILE");
+  if (spec == NULL || parse_segment(strdup(spec)))
+    usage();
+
+  fd = open64(file_name, dry_run ? O_RDONLY : O_RDWR);
+  if (fd < 0 || fstat64(fd, &st) != 0) {
+    fprintf(stderr, "fawrap-sparsify: %s: %s\n", file_name, strerror(errno));
+    return 1;
+  }
+
+  if (block_size == 0)
+    block_size = st.st_blksize;
+  if (block_size < 512 || block_size % (4 * sizeof(vec_t)) != 0 || CHUNK % block_size != 0)
+    block_size = 4096;
+
+  if (threads == 0) {
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus < 1 ? 1 : cpus > 8 ? 8 : cpus;
+  }
+
+  /* holes can only be punched in whole blocks of the file */
+  if (segment_offset + segment_len > st.st_size)
+    segment_len = st.st_size > segment_offset ? st.st_size - segment_offset : 0;
+  scan_start = (segment_offset + block_size - 1) / block_size * block_size;
+  scan_end = (segment_offset + segment_len) / block_size * block_size;
+  next_chunk = scan_start;
+
+  for (i = 0; i < threads && scan_start < scan_end; i++) {
+    if (pthread_create(&tid[i], NULL, worker, NULL) != 0)
+      break;
+  }
+  while (i-- > 0)
+    pthread_join(tid[i], NULL);
+
+  if (! dry_run && fsync(fd) != 0 && error == 0)
+    error = errno;
+  close(fd);
+
+  printf("scanned %llu bytes, already sparse %llu bytes, %s %llu bytes " \
+    "(block %lld)\n", bytes_scanned, bytes_holes, \
+    dry_run ? "reclaimable" : "reclaimed", bytes_zero, (long long) block_size);
+
+  if (error != 0) {
+    fprintf(stderr, "fawrap-sparsify: %s: %s\n", file_name, strerror(error));
+    return 1;
+  }
+
+  return 0;
+}
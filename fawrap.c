@@ -39,6 +39,16 @@
 #define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <poll.h>
 #include <dlfcn.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -48,6 +58,16 @@
 #include <string.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <endian.h>
+#include <time.h>
+#include <limits.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <linux/io_uring.h>
+#include "fawrap-delta.h"
 
 #define DEFINE_FUNC(type, name, ...) \
   typedef type (*t_##name) (__VA_ARGS__); \
@@ -66,8 +86,23 @@ DEFINE_FUNC(int, __xstat, int x, const char *path, struct stat *buf);
 DEFINE_FUNC(int, __xstat64, int x, const char *path, struct stat64 *buf);
 DEFINE_FUNC(int, fstat, int fd, struct stat *buf);
 DEFINE_FUNC(int, fstat64, int fd, struct stat64 *buf);
+DEFINE_FUNC(int, __fxstat, int vers, int fd, struct stat *buf);
 DEFINE_FUNC(int, __fxstat64, int vers, int fd, struct stat64 *buf);
-DEFINE_FUNC(int, fallocate, int fd, int mode, off_t offset, off_t len);
+DEFINE_FUNC(int, stat, const char *path, struct stat *buf);
+DEFINE_FUNC(int, stat64, const char *path, struct stat64 *buf);
+DEFINE_FUNC(int, fstatat, int dirfd, const char *path, struct stat *buf, int flags);
+DEFINE_FUNC(int, fstatat64, int dirfd, const char *path, struct stat64 *buf, int flags);
+DEFINE_FUNC(int, statx, int dirfd, const char *path, int flags, unsigned int mask, struct statx *buf);
+DEFINE_FUNC(int, ftruncate, int fd, off_t length);
+DEFINE_FUNC(int, ftruncate64, int fd, off64_t length);
+DEFINE_FUNC(int, fallocate64, int fd, int mode, off64_t offset, off64_t len);
+DEFINE_FUNC(int, fsync, int fd);
+DEFINE_FUNC(int, fdatasync, int fd);
+DEFINE_FUNC(void, sync, void);
+DEFINE_FUNC(int, syncfs, int fd);
+DEFINE_FUNC(int, ioctl, int fd, unsigned long request, ...);
+DEFINE_FUNC(ssize_t, read, int fd, void *buf, size_t count);
+DEFINE_FUNC(ssize_t, write, int fd, const void *buf, size_t count);
 DEFINE_FUNC(ssize_t, pread64, int fd, void *buf, size_t count, off64_t offset);
 DEFINE_FUNC(ssize_t, pwrite64, int fd, const void *buf, size_t count, off64_t offset);
 
@@ -75,8 +110,46 @@ DEFINE_FUNC(ssize_t, pwrite64, int fd, const void *buf, size_t count, off64_t of
    2 different fd's (transform to linked list one day) */
 #define MAX_FD 16
 
+/* fds below FD_MAP_SIZE are classified with a single table lookup,
+   fds above it are rare and are probed right at open */
+#define FD_MAP_SIZE 1024
+
+#define FD_NONE   0   /* not opened by path or already known as not ours */
+#define FD_PROBE  1   /* opened by path, identity checked on first use */
+#define FD_TARGET 2   /* and above, FD_TARGET + index into target_fd */
+
+struct target {
+  int fd;
+  int flags;    /* file status flags at open */
+  off64_t ra_next;     /* where a sequential read would start */
+  off64_t ra_window;   /* current readahead window */
+  off64_t ra_end;      /* prefetched up to here */
+};
+
+/* paths known to resolve to the target (given name, canonical
+   path, symlinks found by stat); fast pre-filter is a bitmask
+   of path lengths, then hash and finally strcmp */
+#define MAX_ALIAS 16
+
+struct alias {
+  size_t len;
+  uint32_t hash;
+  char *path;
+};
+
 static char *target_name = NULL;
-static int target_fd[MAX_FD];
+static struct target target_fd[MAX_FD];
+static unsigned char fd_map[FD_MAP_SIZE];
+static struct alias alias_cache[MAX_ALIAS];
+static int alias_count = 0;
+static uint64_t alias_lens = 0;
+static bool target_known = false;   /* identity below is valid */
+static bool target_used = false;    /* opened by this process */
+static void (*target_write_hook)(void) = NULL;   /* on open for writing */
+static dev_t target_dev;
+static ino_t target_ino;
+static struct stat64 target_stat;   /* last fstat of target */
+static bool target_stat_valid = false;
 static off64_t segment_offset = 0;
 static off64_t segment_len = 0;
 static FILE *debug_stream;
@@ -87,18 +160,10 @@ static char debug_level = 2;
 #define LOG_INFO  3   /* only redirected calls */
 #define LOG_DBG   4   /* all calls */
 
-void dprint(char level, bool our, const char *fmt, ...) {
+void dprint_msg(const char *fmt, ...) {
 static char buf[512];
 va_list args;
 
-  /* for dbg all system calls are printed */
-  if (debug_level < LOG_DBG) {
-    if (! (debug_level == LOG_INFO && our)) {
-      if (level > debug_level)
-        return;
-    }
-  }
-
   va_start(args, fmt);
   vsnprintf(buf, sizeof(buf), fmt, args);
   va_end(args);
@@ -111,30 +176,135 @@ va_list args;
   }
 }
 
+/* for dbg all system calls are printed; level is checked before
+   arguments are evaluated so disabled messages cost one compare */
+#define dprint(level, our, ...) \
+  do { \
+    if ((level) <= debug_level || (debug_level == LOG_INFO && (our))) \
+      dprint_msg(__VA_ARGS__); \
+  } while (0)
+
+/* counters shown at exit, on stderr with stats option */
+static bool show_stats = false;
+
+void report(const char *fmt, ...) {
+char buf[512];
+va_list args;
+
+  va_start(args, fmt);
+  vsnprintf(buf, sizeof(buf), fmt, args);
+  va_end(args);
+
+  if (show_stats)
+    fprintf(stderr, "fawrap.so %s\n", buf);
+  dprint(LOG_INFO, true, "fawrap.so %s", buf);
+}
+
+static uint32_t path_hash(const char *path, size_t len) {
+uint32_t h = 2166136261u;   /* FNV-1a */
+size_t i;
+
+  for (i = 0; i < len; i++)
+    h = (h ^ (unsigned char) path[i]) * 16777619u;
+
+  return h;
+}
+
+void add_alias(const char *path) {
+struct alias *a;
+size_t len = strlen(path);
+uint32_t hash = path_hash(path, len);
+int i;
+
+  for (i = 0; i < alias_count; i++) {
+    if (alias_cache[i].hash == hash && strcmp(alias_cache[i].path, path) == 0)
+      return;
+  }
+
+  if (alias_count == MAX_ALIAS)
+    return;   /* still matched by identity, only slower */
+
+  a = &alias_cache[alias_count];
+  a->path = strdup(path);
+  if (a->path == NULL)
+    return;
+
+  a->len = len;
+  a->hash = hash;
+  alias_lens |= 1ULL << (len & 63);
+  alias_count++;
+
+  dprint(LOG_INFO, true, "fawrap.so       alias: %s", path);
+}
+
 bool check_name(const char *path) {
-  if (strcmp(path, target_name) == 0)
-    return true;
+size_t len;
+uint32_t hash;
+int i;
+
+  len = strlen(path);
+  if (! (alias_lens & (1ULL << (len & 63))))
+    return false;
+
+  hash = path_hash(path, len);
+  for (i = 0; i < alias_count; i++) {
+    if (alias_cache[i].len == len && alias_cache[i].hash == hash &&
+        memcmp(alias_cache[i].path, path, len) == 0)
+      return true;
+  }
 
   return false;
 }
 
-bool check_fd(int fd) {
+/* same device and inode as the target, for results of stat calls */
+bool check_ino(dev_t dev, ino_t ino) {
+  return target_known && ino == target_ino && dev == target_dev;
+}
+
+/* learn target identity if file did not exist at startup */
+void set_identity(dev_t dev, ino_t ino) {
+  if (target_known)
+    return;
+
+  target_dev = dev;
+  target_ino = ino;
+  target_known = true;
+  dprint(LOG_INFO, true, "fawrap.so       inode: %llu:%llu", \
+    (unsigned long long) dev, (unsigned long long) ino);
+}
+
+struct target *find_fd(int fd) {
 int i;
 
+  if (fd >= 0 && fd < FD_MAP_SIZE) {
+    if (fd_map[fd] < FD_TARGET)
+      return NULL;
+    return &target_fd[fd_map[fd] - FD_TARGET];
+  }
+
   for (i = 0; i < MAX_FD; i++) {
-    if (fd == target_fd[i])
-      return true;
+    if (fd == target_fd[i].fd)
+      return &target_fd[i];
   }
 
-  return false;
+  return NULL;
 }
 
 bool add_fd(int fd) {
 int i;
 
   for (i = 0; i < MAX_FD; i++) {
-    if (target_fd[i] == 0) {
-      target_fd[i] = fd;
+    if (target_fd[i].fd == -1) {
+      target_fd[i].fd = fd;
+      target_fd[i].flags = fcntl(fd, F_GETFL);
+      target_used = true;
+      if ((target_fd[i].flags & O_ACCMODE) != O_RDONLY && target_write_hook != NULL)
+        target_write_hook();
+      target_fd[i].ra_next = -1;
+      target_fd[i].ra_window = 0;
+      target_fd[i].ra_end = 0;
+      if (fd < FD_MAP_SIZE)
+        fd_map[fd] = FD_TARGET + i;
       return false;
     }
   }
@@ -142,34 +312,5586 @@ int i;
   return true;
 }
 
-void remove_fd(int fd) {
-int i;
+void remove_fd(int fd) {
+struct target *t = find_fd(fd);
+
+  if (fd < FD_MAP_SIZE)
+    fd_map[fd] = FD_NONE;
+
+  if (t != NULL) {
+    t->fd = -1;
+    return;
+  }
+
+  dprint(LOG_ERR, true, "%s(error line %d)", __FUNCTION__, __LINE__);
+  exit(1);
+}
+
+/* stat, fstat and 64 bit variants are exported by glibc only since
+   2.33, older versions have just the versioned __xstat family */
+int real_stat64(const char *path, struct stat64 *buf) {
+  if (p_stat64 != NULL)
+    return p_stat64(path, buf);
+
+#ifdef _STAT_VER
+  return p___xstat64(_STAT_VER, path, buf);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+int real_stat(const char *path, struct stat *buf) {
+  if (p_stat != NULL)
+    return p_stat(path, buf);
+
+#ifdef _STAT_VER
+  return p___xstat(_STAT_VER, path, buf);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+int real_fstat(int fd, struct stat *buf) {
+  if (p_fstat != NULL)
+    return p_fstat(fd, buf);
+
+#ifdef _STAT_VER
+  return p___fxstat(_STAT_VER, fd, buf);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+int real_fstat64(int fd, struct stat64 *buf) {
+  if (p_fstat64 != NULL)
+    return p_fstat64(fd, buf);
+
+#ifdef _STAT_VER
+  return p___fxstat64(_STAT_VER, fd, buf);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+/* decide if fd opened by path is the target using its stat data */
+bool classify_fd(int fd, dev_t dev, ino_t ino) {
+  if (! check_ino(dev, ino)) {
+    if (fd < FD_MAP_SIZE)
+      fd_map[fd] = FD_NONE;
+    return false;
+  }
+
+  dprint(LOG_INFO, true, "fd %d is target", fd);
+  if (add_fd(fd)) {
+    dprint(LOG_ERR, true, "%s(error line %d)", __FUNCTION__, __LINE__);
+    exit(1);
+  }
+
+  return true;
+}
+
+/* fd opened by path whose identity is not checked yet */
+bool probe_fd(int fd) {
+struct stat64 st;
+
+  if (real_fstat64(fd, &st) != 0) {
+    if (fd < FD_MAP_SIZE)
+      fd_map[fd] = FD_NONE;
+    return false;
+  }
+
+  return classify_fd(fd, st.st_dev, st.st_ino);
+}
+
+int fd_state(int fd) {
+  if (fd >= 0 && fd < FD_MAP_SIZE)
+    return fd_map[fd] < FD_TARGET ? fd_map[fd] : FD_TARGET;
+
+  return find_fd(fd) ? FD_TARGET : FD_NONE;
+}
+
+bool check_fd(int fd) {
+int state = fd_state(fd);
+
+  if (state == FD_PROBE)
+    return probe_fd(fd);
+
+  return state == FD_TARGET;
+}
+
+/* register fd returned by one of open calls */
+void opened_fd(int fd, const char *path) {
+struct stat64 st;
+
+  if (fd < 0)
+    return;
+
+  /* a known alias is verified immediately, anything else
+     is checked lazily only if it reaches intercepted calls */
+  if (check_name(path) || fd >= FD_MAP_SIZE || ! target_known) {
+    if (real_fstat64(fd, &st) != 0)
+      return;
+
+    if (check_name(path))
+      set_identity(st.st_dev, st.st_ino);
+
+    classify_fd(fd, st.st_dev, st.st_ino);
+    return;
+  }
+
+  fd_map[fd] = FD_PROBE;
+}
+
+/* stat of a path: compare identity for free, remember new aliases */
+bool check_path(const char *path, dev_t dev, ino_t ino) {
+  if (! check_ino(dev, ino))
+    return false;
+
+  if (! check_name(path))
+    add_alias(path);
+
+  return true;
+}
+
+/* fd based stat of a fd that may be target, true if it is;
+   target result is kept until next write or truncate */
+bool stat_fd(int fd, int state, dev_t dev, ino_t ino) {
+  if (state == FD_PROBE)
+    return classify_fd(fd, dev, ino);
+
+  return state == FD_TARGET;
+}
+
+void stat_store(const void *buf, size_t size) {
+  if (size != sizeof(target_stat))
+    return;
+
+  memcpy(&target_stat, buf, size);
+  target_stat_valid = true;
+}
+
+bool stat_load(int state, void *buf, size_t size) {
+  if (state != FD_TARGET || ! target_stat_valid || size != sizeof(target_stat))
+    return false;
+
+  memcpy(buf, &target_stat, size);
+  return true;
+}
+
+void stat_invalidate(void) {
+  target_stat_valid = false;
+}
+
+/* small pool of worker threads: parallel_run() hands items
+   0..count-1 to workers and to the caller and returns when all
+   of them are done; workers are started on first use */
+#define MAX_THREADS 64
+
+struct pool_job {
+  void (*fn)(size_t item, void *ctx);
+  void *ctx;
+  size_t count;
+  size_t next;
+  size_t done;
+};
+
+static int io_threads = 0;   /* 0 - number of cpus, max 8 */
+static int pool_started = 0;
+static struct pool_job *pool_job = NULL;
+static pthread_mutex_t pool_run_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_idle = PTHREAD_COND_INITIALIZER;
+static __thread bool pool_inside = false;   /* running an item */
+
+/* take and run items of current job, called with pool_lock held */
+void pool_work(struct pool_job *job) {
+size_t item;
+
+  while (job->next < job->count) {
+    item = job->next++;
+    pthread_mutex_unlock(&pool_lock);
+    pool_inside = true;
+    job->fn(item, job->ctx);
+    pool_inside = false;
+    pthread_mutex_lock(&pool_lock);
+
+    if (++job->done == job->count)
+      pthread_cond_broadcast(&pool_idle);
+  }
+}
+
+void *pool_thread(void *arg) {
+  pthread_mutex_lock(&pool_lock);
+  for (;;) {
+    while (pool_job == NULL || pool_job->next == pool_job->count)
+      pthread_cond_wait(&pool_wake, &pool_lock);
+
+    pool_work(pool_job);
+  }
+
+  return NULL;
+}
+
+int pool_threads(void) {
+long cpus;
+
+  if (io_threads == 0) {
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    io_threads = cpus < 1 ? 1 : cpus > 8 ? 8 : cpus;
+  }
+
+  return io_threads;
+}
+
+/* run job on pool, called with pool_run_lock held */
+void pool_run(struct pool_job *job) {
+pthread_t tid;
+
+  pthread_mutex_lock(&pool_lock);
+
+  /* caller is one of the workers */
+  while (pool_started < pool_threads() - 1) {
+    if (pthread_create(&tid, NULL, pool_thread, NULL) != 0)
+      break;
+    pthread_detach(tid);
+    pool_started++;
+  }
+
+  pool_job = job;
+  pthread_cond_broadcast(&pool_wake);
+  pool_work(job);
+
+  while (job->done < job->count)
+    pthread_cond_wait(&pool_idle, &pool_lock);
+
+  pool_job = NULL;
+  pthread_mutex_unlock(&pool_lock);
+}
+
+void parallel_run(size_t count, void (*fn)(size_t item, void *ctx), void *ctx) {
+struct pool_job job = { fn, ctx, count, 0, 0 };
+
+  if (count == 0)
+    return;
+
+  /* item of a job (split piece reaching striped map) can't wait
+     for the pool it is part of: its items are run here */
+  if (pool_inside) {
+    for (job.next = 0; job.next < count; job.next++)
+      fn(job.next, ctx);
+    return;
+  }
+
+  pthread_mutex_lock(&pool_run_lock);
+  pool_run(&job);
+  pthread_mutex_unlock(&pool_run_lock);
+}
+
+/* parallel_run() unless pool is busy with another job, true then
+   and nothing is run */
+bool parallel_try(size_t count, void (*fn)(size_t item, void *ctx), void *ctx) {
+struct pool_job job = { fn, ctx, count, 0, 0 };
+
+  if (count == 0)
+    return false;
+
+  if (pool_inside || pthread_mutex_trylock(&pool_run_lock) != 0)
+    return true;
+
+  pool_run(&job);
+  pthread_mutex_unlock(&pool_run_lock);
+  return false;
+}
+
+/* bitmaps of blocks or chunks of the segment */
+struct bitmap {
+  uint64_t *bits;
+  size_t size;
+};
+
+bool bitmap_alloc(struct bitmap *map, size_t size) {
+  map->size = size;
+  map->bits = calloc((size + 63) / 64, sizeof(uint64_t));
+  return map->bits == NULL;
+}
+
+static inline bool bitmap_test(const struct bitmap *map, size_t bit) {
+  return map->bits[bit / 64] & (1ULL << (bit % 64));
+}
+
+/* set bits from first to last, inclusive */
+void bitmap_set(struct bitmap *map, size_t first, size_t last) {
+size_t bit;
+
+  for (bit = first; bit <= last && bit < map->size; bit++)
+    __atomic_fetch_or(&map->bits[bit / 64], 1ULL << (bit % 64), __ATOMIC_RELAXED);
+}
+
+/* clear bits from first to last, inclusive */
+void bitmap_clear(struct bitmap *map, size_t first, size_t last) {
+size_t bit;
+
+  for (bit = first; bit <= last && bit < map->size; bit++)
+    __atomic_fetch_and(&map->bits[bit / 64], ~(1ULL << (bit % 64)), __ATOMIC_RELAXED);
+}
+
+/* whole buffer at *pos of out, true on error */
+static bool write_all(int out, const void *buf, size_t len, off64_t *pos) {
+ssize_t res = p_pwrite64(out, buf, len, *pos);
+
+  if (res != (ssize_t) len) {
+    if (res >= 0)
+      errno = ENOSPC;
+    return true;
+  }
+
+  *pos += len;
+  return false;
+}
+
+/* little endian fields of on-disk structures */
+static inline uint16_t get16(const unsigned char *p) {
+  return p[0] | p[1] << 8;
+}
+
+static inline uint32_t get32(const unsigned char *p) {
+  return get16(p) | (uint32_t) get16(p + 2) << 16;
+}
+
+static inline void put32(unsigned char *p, uint32_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+/* buffer contains only zeros */
+bool is_zero(const void *buf, size_t len) {
+const unsigned char *p = buf;
+
+  if (len == 0)
+    return true;
+
+  return p[0] == 0 && memcmp(p, p + 1, len - 1) == 0;
+}
+
+/* block device as target: its size comes from BLKGETSIZE64 and the
+   segment must be aligned to its logical block size */
+static bool target_blkdev = false;
+static int target_lbs = 512;     /* logical block size */
+
+bool blkdev_init(void) {
+struct stat64 st;
+uint64_t size;
+int fd;
+
+  if (real_stat64(target_name, &st) != 0 || ! S_ISBLK(st.st_mode))
+    return false;
+
+  fd = p_open64(target_name, O_RDONLY);
+  if (fd < 0 || p_ioctl(fd, BLKGETSIZE64, &size) != 0 || \
+      p_ioctl(fd, BLKSSZGET, &target_lbs) != 0) {
+    dprint(LOG_ERR, true, "fawrap.so can't get size of %s", target_name);
+    if (fd >= 0)
+      p_close(fd);
+    return true;
+  }
+  p_close(fd);
+  target_blkdev = true;
+
+  /* length 0 takes rest of device */
+  if (segment_len == 0 && segment_offset < (off64_t) size)
+    segment_len = size - segment_offset;
+
+  if (segment_offset % target_lbs != 0 || segment_len % target_lbs != 0) {
+    dprint(LOG_ERR, true, "fawrap.so segment not aligned to %d byte blocks", target_lbs);
+    return true;
+  }
+
+  if (segment_offset + segment_len > (off64_t) size || segment_len == 0) {
+    dprint(LOG_ERR, true, "fawrap.so segment past end of %s (%llu bytes)", \
+      target_name, (unsigned long long) size);
+    return true;
+  }
+
+  dprint(LOG_INFO, true, "fawrap.so block device: %llu bytes, %d byte blocks", \
+    (unsigned long long) size, target_lbs);
+  return false;
+}
+
+/* segment I/O engines; offsets are relative to segment start
+   and requests are already clipped to the segment */
+struct engine {
+  const char *name;
+  bool (*init)(void);   /* true on error */
+  ssize_t (*pread)(int fd, void *buf, size_t count, off64_t offset);
+  ssize_t (*pwrite)(int fd, const void *buf, size_t count, off64_t offset);
+  int (*fallocate)(int fd, int mode, off64_t offset, off64_t len);
+  int (*flush)(int fd, bool data_only);   /* durability point */
+  int (*close)(int fd);   /* before target fd is closed, barrier */
+  void (*prefetch)(off64_t offset, off64_t len);   /* default readahead */
+  void (*fini)(void);
+};
+
+/* plain access through the caller's own fd */
+ssize_t direct_pread(int fd, void *buf, size_t count, off64_t offset) {
+  return p_pread64(fd, buf, count, segment_offset + offset);
+}
+
+ssize_t direct_pwrite(int fd, const void *buf, size_t count, off64_t offset) {
+  return p_pwrite64(fd, buf, count, segment_offset + offset);
+}
+
+int direct_fallocate(int fd, int mode, off64_t offset, off64_t len) {
+  return p_fallocate64(fd, mode, segment_offset + offset, len);
+}
+
+int direct_flush(int fd, bool data_only) {
+  return data_only ? p_fdatasync(fd) : p_fsync(fd);
+}
+
+static const struct engine direct_engine = {
+  .name = "direct",
+  .pread = direct_pread,
+  .pwrite = direct_pwrite,
+  .fallocate = direct_fallocate,
+  .flush = direct_flush,
+};
+
+static const struct engine *engine = &direct_engine;
+
+bool set_engine(const struct engine *e) {
+  if (engine != &direct_engine && engine != e) {
+    dprint(LOG_ERR, true, "fawrap.so engines %s and %s can't be combined", \
+      engine->name, e->name);
+    return true;
+  }
+
+  engine = e;
+  return false;
+}
+
+/* copy-on-write overlay: segment writes go to a sidecar delta file
+   as block records (8 byte block number + data), base image is
+   only read; commit folds delta into base, discard removes it */
+#define OVERLAY_MAGIC "FAWRAPOV"
+#define OVERLAY_BATCH 64   /* new blocks appended per pwritev */
+
+struct overlay_hdr {
+  char magic[8];
+  uint32_t version;
+  uint32_t block_size;
+  uint64_t segment_offset;
+  uint64_t segment_len;
+};
+
+static char *overlay_name = NULL;
+static int overlay_fd = -1;
+static int overlay_base_fd = -1;
+static uint32_t overlay_bs = 4096;
+static uint64_t *overlay_keys = NULL;   /* block + 1, 0 is free slot */
+static uint64_t *overlay_recs = NULL;   /* record index in delta file */
+static size_t overlay_slots = 0;        /* power of 2 */
+static size_t overlay_count = 0;        /* records in delta file */
+static bool overlay_commit = false;
+static bool overlay_discard = false;
+
+static inline off64_t overlay_rec_pos(uint64_t rec) {
+  return sizeof(struct overlay_hdr) + rec * (sizeof(uint64_t) + overlay_bs);
+}
+
+static inline size_t overlay_hash(uint64_t block) {
+  return (block * 0x9E3779B97F4A7C15ULL) >> 17;
+}
+
+/* record of block or -1 */
+int64_t overlay_find(uint64_t block) {
+size_t i;
+
+  if (overlay_slots == 0)
+    return -1;
+
+  for (i = overlay_hash(block); ; i++) {
+    i &= overlay_slots - 1;
+    if (overlay_keys[i] == 0)
+      return -1;
+    if (overlay_keys[i] == block + 1)
+      return overlay_recs[i];
+  }
+}
+
+bool overlay_insert(uint64_t block, uint64_t rec) {
+uint64_t *keys, *recs;
+size_t slots, i, j;
+
+  /* keep load factor under 1/2 */
+  if ((overlay_count + 1) * 2 > overlay_slots) {
+    slots = overlay_slots ? overlay_slots * 2 : 1024;
+    keys = calloc(slots, sizeof(*keys));
+    recs = calloc(slots, sizeof(*recs));
+    if (keys == NULL || recs == NULL) {
+      free(keys);
+      free(recs);
+      return true;
+    }
+
+    for (i = 0; i < overlay_slots; i++) {
+      if (overlay_keys[i] == 0)
+        continue;
+
+      for (j = overlay_hash(overlay_keys[i] - 1); ; j++) {
+        j &= slots - 1;
+        if (keys[j] == 0)
+          break;
+      }
+
+      keys[j] = overlay_keys[i];
+      recs[j] = overlay_recs[i];
+    }
+
+    free(overlay_keys);
+    free(overlay_recs);
+    overlay_keys = keys;
+    overlay_recs = recs;
+    overlay_slots = slots;
+  }
+
+  for (i = overlay_hash(block); ; i++) {
+    i &= overlay_slots - 1;
+    if (overlay_keys[i] == 0)
+      break;
+  }
+
+  overlay_keys[i] = block + 1;
+  overlay_recs[i] = rec;
+  overlay_count++;
+  return false;
+}
+
+/* bytes of block inside segment, last one can be short */
+static inline size_t overlay_block_len(uint64_t block) {
+off64_t left = segment_len - (off64_t) block * overlay_bs;
+
+  return left < overlay_bs ? left : overlay_bs;
+}
+
+bool overlay_init(void) {
+struct overlay_hdr hdr;
+char path[PATH_MAX];
+uint64_t block;
+off64_t size;
+uint64_t rec;
+
+  /* absolute name, tool may change directory before exit */
+  overlay_fd = p_open(overlay_name, O_RDWR | O_CREAT, 0644);
+  if (overlay_fd < 0 || realpath(overlay_name, path) == NULL) {
+    dprint(LOG_ERR, true, "fawrap.so can't open overlay %s", overlay_name);
+    return true;
+  }
+
+  overlay_name = strdup(path);
+  size = p_lseek64(overlay_fd, 0, SEEK_END);
+
+  if (size == 0) {
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, OVERLAY_MAGIC, sizeof(hdr.magic));
+    hdr.version = 1;
+    hdr.block_size = overlay_bs;
+    hdr.segment_offset = segment_offset;
+    hdr.segment_len = segment_len;
+    if (p_pwrite64(overlay_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+      return true;
+  } else {
+    if (p_pread64(overlay_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        memcmp(hdr.magic, OVERLAY_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != 1 || hdr.block_size == 0) {
+      dprint(LOG_ERR, true, "fawrap.so %s is not an overlay", overlay_name);
+      return true;
+    }
+
+    if (hdr.segment_offset != segment_offset || hdr.segment_len != segment_len) {
+      dprint(LOG_ERR, true, "fawrap.so overlay %s is for segment %llu,%llu", \
+        overlay_name, hdr.segment_offset, hdr.segment_len);
+      return true;
+    }
+
+    overlay_bs = hdr.block_size;
+
+    /* rebuild index, records after a torn append are dropped */
+    for (rec = 0; overlay_rec_pos(rec + 1) <= size; rec++) {
+      if (p_pread64(overlay_fd, &block, sizeof(block), overlay_rec_pos(rec)) != sizeof(block))
+        return true;
+      if (overlay_insert(block, rec))
+        return true;
+    }
+  }
+
+  /* base is read through own fd, tool may open it write-only */
+  overlay_base_fd = p_open64(target_name, overlay_commit ? O_RDWR : O_RDONLY);
+  if (overlay_base_fd < 0) {
+    dprint(LOG_ERR, true, "fawrap.so can't open %s", target_name);
+    return true;
+  }
+
+  dprint(LOG_INFO, true, "fawrap.so     overlay: %s (%llu blocks of %u)", \
+    overlay_name, (unsigned long long) overlay_count, overlay_bs);
+  return false;
+}
+
+ssize_t overlay_pread(int fd, void *buf, size_t count, off64_t offset) {
+size_t done = 0;
+size_t n, skip;
+uint64_t block;
+int64_t rec;
+ssize_t res;
+
+  while (done < count) {
+    block = (offset + done) / overlay_bs;
+    skip = (offset + done) % overlay_bs;
+    n = overlay_bs - skip;
+    if (n > count - done)
+      n = count - done;
+
+    rec = overlay_find(block);
+    if (rec >= 0) {
+      res = p_pread64(overlay_fd, (char *) buf + done, n, \
+        overlay_rec_pos(rec) + sizeof(uint64_t) + skip);
+    } else {
+      /* one base read for a run of blocks not in delta */
+      while (done + n < count && overlay_find(++block) < 0)
+        n += (count - done - n) < overlay_bs ? (count - done - n) : overlay_bs;
+
+      res = p_pread64(overlay_base_fd, (char *) buf + done, n, \
+        segment_offset + offset + done);
+    }
+
+    if (res < 0)
+      return done ? (ssize_t) done : -1;
+
+    done += res;
+    if ((size_t) res < n)
+      break;
+  }
+
+  return done;
+}
+
+/* append records for count new blocks starting at block */
+bool overlay_append(uint64_t block, const char *data, size_t count) {
+struct iovec iov[2 * OVERLAY_BATCH];
+uint64_t keys[OVERLAY_BATCH];
+size_t i;
+
+  for (i = 0; i < count; i++) {
+    keys[i] = block + i;
+    iov[2 * i].iov_base = &keys[i];
+    iov[2 * i].iov_len = sizeof(uint64_t);
+    iov[2 * i + 1].iov_base = (char *) data + i * overlay_bs;
+    iov[2 * i + 1].iov_len = overlay_bs;
+  }
+
+  if (pwritev64(overlay_fd, iov, 2 * count, overlay_rec_pos(overlay_count)) != \
+      (ssize_t) (count * (sizeof(uint64_t) + overlay_bs)))
+    return true;
+
+  for (i = 0; i < count; i++) {
+    if (overlay_insert(block + i, overlay_count))
+      return true;
+  }
+
+  return false;
+}
+
+ssize_t overlay_pwrite(int fd, const void *buf, size_t count, off64_t offset) {
+const char *src = buf;
+size_t done = 0;
+size_t n, skip, run;
+uint64_t block;
+int64_t rec;
+ssize_t res;
+char *tmp;
+
+  while (done < count) {
+    block = (offset + done) / overlay_bs;
+    skip = (offset + done) % overlay_bs;
+    n = overlay_bs - skip;
+    if (n > count - done)
+      n = count - done;
+
+    rec = overlay_find(block);
+    if (rec >= 0) {
+      res = p_pwrite64(overlay_fd, src + done, n, \
+        overlay_rec_pos(rec) + sizeof(uint64_t) + skip);
+      if (res != (ssize_t) n)
+        break;
+    } else if (n == overlay_bs) {
+      /* whole new blocks go straight from caller buffer */
+      for (run = 1; run < OVERLAY_BATCH && done + (run + 1) * overlay_bs <= count; run++) {
+        if (overlay_find(block + run) >= 0)
+          break;
+      }
+
+      n = run * overlay_bs;
+      if (overlay_append(block, src + done, run))
+        break;
+    } else {
+      /* partial new block, rest of it comes from base */
+      tmp = calloc(1, overlay_bs);
+      if (tmp == NULL)
+        break;
+
+      res = p_pread64(overlay_base_fd, tmp, overlay_block_len(block), \
+        segment_offset + (off64_t) block * overlay_bs);
+      if (res >= 0) {
+        memcpy(tmp + skip, src + done, n);
+        if (overlay_append(block, tmp, 1))
+          res = -1;
+      }
+
+      free(tmp);
+      if (res < 0)
+        break;
+    }
+
+    done += n;
+  }
+
+  if (done == 0 && count > 0)
+    return -1;
+
+  return done;
+}
+
+int overlay_fallocate(int fd, int mode, off64_t offset, off64_t len) {
+static const char zero[65536];
+off64_t done = 0;
+ssize_t res;
+size_t n;
+
+  if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+    errno = EOPNOTSUPP;
+    return -1;
+  }
+
+  /* plain allocation: segment space always exists */
+  if (! (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)))
+    return 0;
+
+  while (done < len) {
+    n = len - done < (off64_t) sizeof(zero) ? len - done : sizeof(zero);
+    res = overlay_pwrite(fd, zero, n, offset + done);
+    if (res <= 0)
+      return -1;
+    done += res;
+  }
+
+  return 0;
+}
+
+/* fold delta back into base image */
+bool overlay_fold(void) {
+char *buf;
+uint64_t rec;
+uint64_t block;
+size_t len;
+
+  buf = malloc(sizeof(uint64_t) + overlay_bs);
+  if (buf == NULL)
+    return true;
+
+  for (rec = 0; rec < overlay_count; rec++) {
+    if (p_pread64(overlay_fd, buf, sizeof(uint64_t) + overlay_bs, overlay_rec_pos(rec)) != \
+        (ssize_t) (sizeof(uint64_t) + overlay_bs))
+      break;
+
+    memcpy(&block, buf, sizeof(block));
+    len = overlay_block_len(block);
+    if (p_pwrite64(overlay_base_fd, buf + sizeof(uint64_t), len, \
+        segment_offset + (off64_t) block * overlay_bs) != (ssize_t) len)
+      break;
+  }
+
+  free(buf);
+  if (rec < overlay_count || fdatasync(overlay_base_fd) != 0) {
+    dprint(LOG_ERR, true, "fawrap.so overlay commit failed at block record %llu", \
+      (unsigned long long) rec);
+    return true;
+  }
+
+  dprint(LOG_INFO, true, "fawrap.so overlay committed %llu blocks", \
+    (unsigned long long) overlay_count);
+  return false;
+}
+
+int overlay_flush(int fd, bool data_only) {
+  return p_fdatasync(overlay_fd);
+}
+
+void overlay_fini(void) {
+  /* only a process that used the target ends the session, not
+     children inheriting FILE */
+  if (target_used) {
+    if (overlay_commit && overlay_fold() == false)
+      overlay_discard = true;
+
+    if (overlay_discard)
+      unlink(overlay_name);
+  }
+
+  p_close(overlay_base_fd);
+  p_close(overlay_fd);
+}
+
+static const struct engine overlay_engine = {
+  .name = "overlay",
+  .init = overlay_init,
+  .pread = overlay_pread,
+  .pwrite = overlay_pwrite,
+  .fallocate = overlay_fallocate,
+  .flush = overlay_flush,
+  .fini = overlay_fini,
+};
+
+/* segment staged in memory: loaded at start (or zero filled),
+   all I/O is memcpy and dirty chunks are written back at exit
+   by parallel sequential writes; zero chunks become holes */
+#define RAM_CHUNK (64 << 10)     /* dirty tracking granularity */
+#define RAM_IO (8 << 20)         /* load and write back unit */
+
+static off64_t ram_budget = 0;   /* 0 - half of physical memory */
+static bool ram_zero = false;
+static char *ram_mem = NULL;
+static size_t ram_map_len;
+static int ram_fd = -1;          /* own fd of target for load and flush */
+static struct bitmap ram_dirty;
+static off64_t ram_flushed;
+static bool ram_error = false;
+
+/* map memory: hugetlb memfd, plain memfd, anonymous */
+bool ram_map(void) {
+size_t huge = 2 << 20;
+int mfd;
+
+  ram_map_len = (segment_len + huge - 1) & ~(huge - 1);
+  mfd = memfd_create("fawrap", MFD_CLOEXEC | MFD_HUGETLB);
+  if (mfd >= 0 && ftruncate(mfd, ram_map_len) == 0) {
+    ram_mem = mmap(NULL, ram_map_len, PROT_READ | PROT_WRITE, MAP_SHARED, mfd, 0);
+    p_close(mfd);
+    if (ram_mem != MAP_FAILED) {
+      dprint(LOG_INFO, true, "fawrap.so         ram: hugetlb memfd");
+      return false;
+    }
+  } else if (mfd >= 0)
+    p_close(mfd);
+
+  ram_map_len = segment_len;
+  mfd = memfd_create("fawrap", MFD_CLOEXEC);
+  if (mfd >= 0 && ftruncate(mfd, ram_map_len) == 0) {
+    ram_mem = mmap(NULL, ram_map_len, PROT_READ | PROT_WRITE, MAP_SHARED, mfd, 0);
+    p_close(mfd);
+  } else {
+    if (mfd >= 0)
+      p_close(mfd);
+    ram_mem = mmap(NULL, ram_map_len, PROT_READ | PROT_WRITE, \
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
+
+  if (ram_mem == MAP_FAILED)
+    return true;
+
+  madvise(ram_mem, ram_map_len, MADV_HUGEPAGE);
+  dprint(LOG_INFO, true, "fawrap.so         ram: memfd");
+  return false;
+}
+
+/* load one RAM_IO piece, reading only data regions of the file */
+void ram_load_item(size_t item, void *ctx) {
+off64_t start = (off64_t) item * RAM_IO;
+off64_t end = start + RAM_IO;
+off64_t data, hole;
+ssize_t res;
+
+  if (end > segment_len)
+    end = segment_len;
+
+  while (start < end) {
+    data = p_lseek64(ram_fd, segment_offset + start, SEEK_DATA);
+    if (data < 0)
+      return;   /* ENXIO - only hole up to EOF */
+
+    data -= segment_offset;
+    if (data >= end)
+      return;
+
+    hole = p_lseek64(ram_fd, segment_offset + data, SEEK_HOLE) - segment_offset;
+    if (hole > end || hole <= data)
+      hole = end;
+
+    while (data < hole) {
+      res = p_pread64(ram_fd, ram_mem + data, hole - data, segment_offset + data);
+      if (res <= 0) {
+        if (res < 0)
+          ram_error = true;
+        return;
+      }
+      data += res;
+    }
+
+    start = hole;
+  }
+}
+
+bool ram_init(void) {
+off64_t budget = ram_budget;
+
+  if (budget == 0)
+    budget = (off64_t) sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) / 2;
+
+  if (segment_len > budget) {
+    dprint(LOG_INFO, true, "fawrap.so segment over ram budget %llu, using direct I/O", \
+      (unsigned long long) budget);
+    engine = &direct_engine;
+    return false;
+  }
+
+  ram_fd = p_open64(target_name, O_RDWR);
+  if (ram_fd < 0) {
+    dprint(LOG_ERR, true, "fawrap.so can't open %s", target_name);
+    return true;
+  }
+
+  if (ram_map() || bitmap_alloc(&ram_dirty, (segment_len + RAM_CHUNK - 1) / RAM_CHUNK))
+    return true;
+
+  if (ram_zero) {
+    /* old contents are ignored, whole segment is rewritten */
+    bitmap_set(&ram_dirty, 0, ram_dirty.size - 1);
+  } else {
+    parallel_run((segment_len + RAM_IO - 1) / RAM_IO, ram_load_item, NULL);
+    if (ram_error) {
+      dprint(LOG_ERR, true, "fawrap.so loading segment failed");
+      return true;
+    }
+  }
+
+  return false;
+}
+
+ssize_t ram_pread(int fd, void *buf, size_t count, off64_t offset) {
+  memcpy(buf, ram_mem + offset, count);
+  return count;
+}
+
+ssize_t ram_pwrite(int fd, const void *buf, size_t count, off64_t offset) {
+  if (count == 0)
+    return 0;
+
+  memcpy(ram_mem + offset, buf, count);
+  bitmap_set(&ram_dirty, offset / RAM_CHUNK, (offset + count - 1) / RAM_CHUNK);
+  return count;
+}
+
+int ram_fallocate(int fd, int mode, off64_t offset, off64_t len) {
+  if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+    errno = EOPNOTSUPP;
+    return -1;
+  }
+
+  if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+    memset(ram_mem + offset, 0, len);
+    bitmap_set(&ram_dirty, offset / RAM_CHUNK, (offset + len - 1) / RAM_CHUNK);
+  }
+
+  return 0;
+}
+
+/* last chunk is short if mapping is just the segment */
+static inline size_t ram_chunk_len(size_t chunk) {
+  return (off64_t) (chunk + 1) * RAM_CHUNK <= segment_len ? \
+    RAM_CHUNK : segment_len - (off64_t) chunk * RAM_CHUNK;
+}
+
+/* write back dirty chunks of one RAM_IO piece, merged into
+   runs of data and runs of zeros */
+void ram_flush_item(size_t item, void *ctx) {
+size_t first = item * (RAM_IO / RAM_CHUNK);
+size_t last = first + RAM_IO / RAM_CHUNK;
+size_t chunk, run;
+off64_t start, len;
+bool zero;
+ssize_t res;
+
+  if (last > ram_dirty.size)
+    last = ram_dirty.size;
+
+  for (chunk = first; chunk < last; chunk = run) {
+    if (! bitmap_test(&ram_dirty, chunk)) {
+      run = chunk + 1;
+      continue;
+    }
+
+    zero = is_zero(ram_mem + chunk * RAM_CHUNK, ram_chunk_len(chunk));
+    for (run = chunk + 1; run < last && bitmap_test(&ram_dirty, run); run++) {
+      if (is_zero(ram_mem + run * RAM_CHUNK, ram_chunk_len(run)) != zero)
+        break;
+    }
+
+    start = (off64_t) chunk * RAM_CHUNK;
+    len = (off64_t) (run - chunk) * RAM_CHUNK;
+    if (start + len > segment_len)
+      len = segment_len - start;
+
+    /* punching a hole zeroes and frees space, writing is fallback */
+    if (zero && p_fallocate64(ram_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, \
+        segment_offset + start, len) == 0)
+      continue;
+
+    while (len > 0) {
+      res = p_pwrite64(ram_fd, ram_mem + start, len, segment_offset + start);
+      if (res <= 0) {
+        ram_error = true;
+        return;
+      }
+
+      __atomic_fetch_add(&ram_flushed, res, __ATOMIC_RELAXED);
+      start += res;
+      len -= res;
+    }
+  }
+}
+
+/* everything is in memory already */
+void ram_prefetch(off64_t offset, off64_t len) {
+}
+
+/* memory is written back only at exit */
+int ram_flush(int fd, bool data_only) {
+  return 0;
+}
+
+void ram_fini(void) {
+  /* process never opened target (child of a build script, ...),
+     memory is not newer than the image, with ramzero even older */
+  if (! target_used) {
+    p_close(ram_fd);
+    return;
+  }
+
+  parallel_run((segment_len + RAM_IO - 1) / RAM_IO, ram_flush_item, NULL);
+
+  if (ram_error || fdatasync(ram_fd) != 0)
+    dprint(LOG_ERR, true, "fawrap.so writing segment back failed");
+  else
+    dprint(LOG_INFO, true, "fawrap.so ram flushed %llu bytes", \
+      (unsigned long long) ram_flushed);
+
+  p_close(ram_fd);
+}
+
+static const struct engine ram_engine = {
+  .name = "ram",
+  .init = ram_init,
+  .pread = ram_pread,
+  .pwrite = ram_pwrite,
+  .fallocate = ram_fallocate,
+  .flush = ram_flush,
+  .prefetch = ram_prefetch,
+  .fini = ram_fini,
+};
+
+/* segment mapped once, positional I/O is memcpy to and from
+   the page cache; durability points become msync of the range */
+#define MMAP_NORMAL   0
+#define MMAP_POPULATE 1
+#define MMAP_RANDOM   2
+#define MMAP_SEQ      3
+
+static int mmap_hint = MMAP_NORMAL;
+static int mmap_fd = -1;
+static char *mmap_base = NULL;    /* page aligned start of mapping */
+static char *mmap_mem = NULL;     /* segment start */
+static size_t mmap_len;
+static int mmap_prot;
+static bool mmap_short = false;   /* mapped on first open for writing */
+static const struct engine *mmap_self;
+static pthread_mutex_t mmap_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long long mmap_reads = 0;
+static unsigned long long mmap_writes = 0;
+
+/* map segment of mmap_fd, true if direct I/O is used instead */
+bool mmap_map(void) {
+long page = sysconf(_SC_PAGESIZE);
+off64_t start = segment_offset & ~((off64_t) page - 1);
+
+  mmap_len = segment_offset + segment_len - start;
+  mmap_base = mmap(NULL, mmap_len, mmap_prot, \
+    MAP_SHARED | (mmap_hint == MMAP_POPULATE ? MAP_POPULATE : 0), mmap_fd, start);
+  if (mmap_base == MAP_FAILED) {
+    dprint(LOG_INFO, true, "fawrap.so can't map segment, using direct I/O");
+    p_close(mmap_fd);
+    engine = &direct_engine;
+    return true;
+  }
+
+  if (mmap_hint == MMAP_RANDOM)
+    madvise(mmap_base, mmap_len, MADV_RANDOM);
+  else if (mmap_hint == MMAP_SEQ)
+    madvise(mmap_base, mmap_len, MADV_SEQUENTIAL);
+
+  mmap_mem = mmap_base + (segment_offset - start);
+  return false;
+}
+
+/* target opened for writing: short file is extended and mapped */
+void mmap_extend(void) {
+  pthread_mutex_lock(&mmap_lock);
+  if (mmap_short) {
+    mmap_short = false;
+    if (p_ftruncate64(mmap_fd, segment_offset + segment_len) != 0) {
+      dprint(LOG_ERR, true, "fawrap.so can't extend %s, using direct I/O", target_name);
+      p_close(mmap_fd);
+    } else if (! mmap_map()) {
+      dprint(LOG_INFO, true, "fawrap.so %s extended to segment end", target_name);
+      engine = mmap_self;
+    }
+  }
+  pthread_mutex_unlock(&mmap_lock);
+}
+
+bool mmap_init(void) {
+struct stat64 st;
+
+  mmap_prot = PROT_READ | PROT_WRITE;
+  mmap_fd = p_open64(target_name, O_RDWR);
+  if (mmap_fd < 0) {
+    mmap_prot = PROT_READ;
+    mmap_fd = p_open64(target_name, O_RDONLY);
+  }
+
+  if (mmap_fd < 0 || real_fstat64(mmap_fd, &st) != 0) {
+    dprint(LOG_ERR, true, "fawrap.so can't open %s", target_name);
+    return true;
+  }
+
+  /* pages past end of file would fault, file of a program that
+     only reads keeps its size: direct I/O until opened for writing */
+  if (S_ISREG(st.st_mode) && st.st_size < segment_offset + segment_len) {
+    dprint(LOG_INFO, true, "fawrap.so %s is shorter than segment, using direct I/O", \
+      target_name);
+    mmap_short = mmap_prot & PROT_WRITE;
+    if (mmap_short)
+      target_write_hook = mmap_extend;
+    else
+      p_close(mmap_fd);
+    mmap_self = engine;
+    engine = &direct_engine;
+    return false;
+  }
+
+  mmap_map();
+  return false;
+}
+
+ssize_t mmap_pread(int fd, void *buf, size_t count, off64_t offset) {
+  memcpy(buf, mmap_mem + offset, count);
+  mmap_reads++;
+  return count;
+}
+
+ssize_t mmap_pwrite(int fd, const void *buf, size_t count, off64_t offset) {
+  memcpy(mmap_mem + offset, buf, count);
+  mmap_writes++;
+  return count;
+}
+
+int mmap_fallocate(int fd, int mode, off64_t offset, off64_t len) {
+  return p_fallocate64(mmap_fd, mode, segment_offset + offset, len);
+}
+
+void mmap_prefetch(off64_t offset, off64_t len) {
+long page = sysconf(_SC_PAGESIZE);
+char *start = mmap_mem + offset;
+char *aligned = (char *) ((unsigned long) start & ~(page - 1));
+
+  madvise(aligned, len + (start - aligned), MADV_WILLNEED);
+}
+
+int mmap_flush(int fd, bool data_only) {
+  return msync(mmap_base, mmap_len, MS_SYNC);
+}
+
+void mmap_fini(void) {
+  report("mmap reads %llu, writes %llu, syscalls avoided %llu", \
+    mmap_reads, mmap_writes, mmap_reads + mmap_writes);
+
+  munmap(mmap_base, mmap_len);
+  p_close(mmap_fd);
+}
+
+static const struct engine mmap_engine = {
+  .name = "mmap",
+  .init = mmap_init,
+  .pread = mmap_pread,
+  .pwrite = mmap_pwrite,
+  .fallocate = mmap_fallocate,
+  .flush = mmap_flush,
+  .prefetch = mmap_prefetch,
+  .fini = mmap_fini,
+};
+
+/* writes to target are copied into registered buffers of a per
+   thread io_uring and queued without a syscall; queue is submitted
+   and reaped in one io_uring_enter at flush points: fsync, close,
+   a read or write overlapping a queued write, or full queue */
+#define URING_BUF (64 << 10)
+
+struct uring {
+  int fd;
+  unsigned entries;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  char *bufs;                   /* entries * URING_BUF, registered */
+  off64_t *pend_off;            /* queued writes, by buffer index */
+  size_t *pend_len;
+  unsigned queued;
+  pthread_mutex_t lock;
+  struct uring *next;
+};
+
+static unsigned uring_depth = 64;
+static int uring_fd = -1;           /* own fd, registered in rings */
+static struct uring *uring_list = NULL;
+static pthread_mutex_t uring_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct uring *uring_tls = NULL;
+static int uring_error = 0;         /* errno of a failed queued write */
+static unsigned long long uring_writes = 0;
+static unsigned long long uring_enters = 0;
+
+struct uring *uring_setup(void) {
+struct io_uring_params params;
+struct iovec *iov;
+struct uring *r;
+size_t sq_len, cq_len;
+char *sq, *cq;
+unsigned i;
+
+  r = calloc(1, sizeof(*r));
+  if (r == NULL)
+    return NULL;
+
+  memset(&params, 0, sizeof(params));
+  r->fd = syscall(__NR_io_uring_setup, uring_depth, &params);
+  if (r->fd < 0) {
+    free(r);
+    return NULL;
+  }
+
+  sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    sq_len = cq_len = sq_len > cq_len ? sq_len : cq_len;
+
+  sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, \
+    r->fd, IORING_OFF_SQ_RING);
+  cq = (params.features & IORING_FEAT_SINGLE_MMAP) ? sq : \
+    mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, \
+    r->fd, IORING_OFF_CQ_RING);
+  r->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), \
+    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (sq == MAP_FAILED || cq == MAP_FAILED || r->sqes == MAP_FAILED)
+    goto fail;
+
+  r->sq_head = (unsigned *) (sq + params.sq_off.head);
+  r->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+  r->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+  r->sq_array = (unsigned *) (sq + params.sq_off.array);
+  r->cq_head = (unsigned *) (cq + params.cq_off.head);
+  r->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+  r->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+  r->entries = params.sq_entries;
+
+  r->bufs = mmap(NULL, (size_t) r->entries * URING_BUF, PROT_READ | PROT_WRITE, \
+    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  r->pend_off = calloc(r->entries, sizeof(off64_t));
+  r->pend_len = calloc(r->entries, sizeof(size_t));
+  iov = calloc(r->entries, sizeof(*iov));
+  if (r->bufs == MAP_FAILED || r->pend_off == NULL || r->pend_len == NULL || iov == NULL)
+    goto fail;
+
+  for (i = 0; i < r->entries; i++) {
+    iov[i].iov_base = r->bufs + (size_t) i * URING_BUF;
+    iov[i].iov_len = URING_BUF;
+  }
+
+  if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, iov, r->entries) != 0 ||
+      syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES, &uring_fd, 1) != 0) {
+    free(iov);
+    goto fail;
+  }
+
+  free(iov);
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_mutex_lock(&uring_list_lock);
+  r->next = uring_list;
+  uring_list = r;
+  pthread_mutex_unlock(&uring_list_lock);
+  return r;
+
+fail:
+  dprint(LOG_ERR, true, "fawrap.so io_uring setup failed");
+  p_close(r->fd);
+  free(r);
+  return NULL;
+}
+
+/* first error of a queued write is kept for the next call */
+static inline void uring_set_error(int err) {
+int none = 0;
+
+  __atomic_compare_exchange_n(&uring_error, &none, err, false, \
+    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/* submit everything queued in ring and wait for all of it,
+   called with ring locked */
+int uring_drain(struct uring *r) {
+struct io_uring_cqe *cqe;
+unsigned submitted = 0;
+unsigned reaped = 0;
+unsigned wanted = r->queued;    /* completions to wait for */
+unsigned head, i;
+bool failed = false;
+ssize_t res;
+int ret;
+
+  while (reaped < wanted) {
+    ret = syscall(__NR_io_uring_enter, r->fd, failed ? 0 : r->queued - submitted, \
+      wanted - reaped, IORING_ENTER_GETEVENTS, NULL, 0);
+    uring_enters++;
+    if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      uring_set_error(errno);
+      if (failed)
+        break;    /* can't even wait, ring is left as it is */
+
+      /* entries kernel did not take are dropped, the ones it took
+         still use their buffers and are waited for */
+      failed = true;
+      head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+      wanted = r->queued - (*r->sq_tail - head);
+      __atomic_store_n(r->sq_tail, head, __ATOMIC_RELEASE);
+      continue;
+    }
+    if (ret > 0 && ! failed)
+      submitted += ret;
+
+    head = *r->cq_head;
+    while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+      cqe = &r->cqes[head & *r->cq_mask];
+      i = cqe->user_data;
+      res = cqe->res;
+
+      /* finish short writes synchronously */
+      while (res >= 0 && (size_t) res < r->pend_len[i]) {
+        ret = p_pwrite64(uring_fd, r->bufs + (size_t) i * URING_BUF + res, \
+          r->pend_len[i] - res, segment_offset + r->pend_off[i] + res);
+        if (ret <= 0) {
+          res = ret < 0 ? -errno : -EIO;
+          break;
+        }
+        res += ret;
+      }
+
+      if (res < 0)
+        uring_set_error(-res);
+
+      r->pend_len[i] = 0;
+      head++;
+      reaped++;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  for (i = 0; i < r->queued; i++)
+    r->pend_len[i] = 0;
+  r->queued = 0;
+  return __atomic_load_n(&uring_error, __ATOMIC_RELAXED) ? -1 : 0;
+}
+
+/* drain rings with a queued write overlapping the range, or all
+   rings for len 0 */
+void uring_drain_range(off64_t offset, size_t len) {
+struct uring *r;
+unsigned i;
+
+  pthread_mutex_lock(&uring_list_lock);
+  for (r = uring_list; r != NULL; r = r->next) {
+    pthread_mutex_lock(&r->lock);
+    for (i = 0; i < r->queued; i++) {
+      if (len == 0 || (r->pend_off[i] < offset + (off64_t) len && \
+          offset < r->pend_off[i] + (off64_t) r->pend_len[i])) {
+        uring_drain(r);
+        break;
+      }
+    }
+    pthread_mutex_unlock(&r->lock);
+  }
+  pthread_mutex_unlock(&uring_list_lock);
+}
+
+/* report failure of an earlier queued write once */
+static inline int uring_take_error(void) {
+int err;
+
+  if (__atomic_load_n(&uring_error, __ATOMIC_RELAXED) == 0)
+    return 0;
+
+  err = __atomic_exchange_n(&uring_error, 0, __ATOMIC_RELAXED);
+  if (err == 0)
+    return 0;
+
+  errno = err;
+  return -1;
+}
+
+bool uring_init(void) {
+struct uring *r;
+
+  uring_fd = p_open64(target_name, O_RDWR);
+  if (uring_fd < 0) {
+    dprint(LOG_ERR, true, "fawrap.so can't open %s", target_name);
+    return true;
+  }
+
+  /* probe kernel support once, in this thread */
+  r = uring_setup();
+  if (r == NULL) {
+    dprint(LOG_INFO, true, "fawrap.so no io_uring, using direct I/O");
+    p_close(uring_fd);
+    engine = &direct_engine;
+    return false;
+  }
+
+  uring_tls = r;
+  return false;
+}
+
+ssize_t uring_pread(int fd, void *buf, size_t count, off64_t offset) {
+  uring_drain_range(offset, count ? count : 1);
+  if (uring_take_error())
+    return -1;
+
+  return p_pread64(fd, buf, count, segment_offset + offset);
+}
+
+ssize_t uring_pwrite(int fd, const void *buf, size_t count, off64_t offset) {
+struct io_uring_sqe *sqe;
+struct uring *r = uring_tls;
+size_t done = 0;
+unsigned tail, i;
+size_t n;
+
+  if (r == NULL) {
+    r = uring_tls = uring_setup();
+    if (r == NULL)
+      return p_pwrite64(fd, buf, count, segment_offset + offset);
+  }
+
+  /* writes of one batch may complete in any order */
+  uring_drain_range(offset, count ? count : 1);
+  if (uring_take_error())
+    return -1;
+
+  pthread_mutex_lock(&r->lock);
+  while (done < count) {
+    if (r->queued == r->entries && uring_drain(r) != 0)
+      break;
+
+    n = count - done < URING_BUF ? count - done : URING_BUF;
+    i = r->queued++;
+    memcpy(r->bufs + (size_t) i * URING_BUF, (const char *) buf + done, n);
+    r->pend_off[i] = offset + done;
+    r->pend_len[i] = n;
+
+    tail = *r->sq_tail;
+    sqe = &r->sqes[tail & *r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = 0;
+    sqe->addr = (unsigned long) (r->bufs + (size_t) i * URING_BUF);
+    sqe->len = n;
+    sqe->off = segment_offset + offset + done;
+    sqe->buf_index = i;
+    sqe->user_data = i;
+    r->sq_array[tail & *r->sq_mask] = tail & *r->sq_mask;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    uring_writes++;
+    done += n;
+  }
+  pthread_mutex_unlock(&r->lock);
+
+  if (done == 0 && count > 0)
+    return uring_take_error();
+
+  return done;
+}
+
+int uring_fallocate(int fd, int mode, off64_t offset, off64_t len) {
+  uring_drain_range(offset, len);
+  if (uring_take_error())
+    return -1;
+
+  return p_fallocate64(uring_fd, mode, segment_offset + offset, len);
+}
+
+int uring_flush(int fd, bool data_only) {
+  uring_drain_range(0, 0);
+  if (uring_take_error())
+    return -1;
+
+  return data_only ? p_fdatasync(uring_fd) : p_fsync(uring_fd);
+}
+
+int uring_close(int fd) {
+  uring_drain_range(0, 0);
+  return uring_take_error();
+}
+
+void uring_fini(void) {
+  uring_drain_range(0, 0);
+  if (uring_take_error())
+    dprint(LOG_ERR, true, "fawrap.so queued write failed: %s", strerror(errno));
+
+  report("io_uring writes %llu, io_uring_enter calls %llu, syscalls avoided %llu", \
+    uring_writes, uring_enters, \
+    uring_writes > uring_enters ? uring_writes - uring_enters : 0);
+
+  p_close(uring_fd);
+}
+
+static const struct engine uring_engine = {
+  .name = "uring",
+  .init = uring_init,
+  .pread = uring_pread,
+  .pwrite = uring_pwrite,
+  .fallocate = uring_fallocate,
+  .flush = uring_flush,
+  .close = uring_close,
+  .fini = uring_fini,
+};
+
+/* write-behind queue: writes are copied into a bounded staging
+   arena and acknowledged, writer threads drain it to a fd; writes
+   overlapping an older queued one wait for it, the first error is
+   kept and reported by the next call */
+struct wq_entry {
+  off64_t offset;
+  size_t len;
+  bool busy;           /* being written */
+  bool blocked;        /* overlapped an older entry when queued */
+  struct wq_entry *next;
+  char data[];
+};
+
+struct wqueue {
+  int fd;
+  off64_t base;        /* added to offsets */
+  size_t limit;        /* staging arena bytes */
+  size_t used;
+  struct wq_entry *head, *tail;
+  int error;
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  int threads;         /* writer threads, 0 writes in place */
+  struct wqueue *next;
+  unsigned long long writes;
+  unsigned long long stalls;
+};
+
+static struct wqueue *wq_list = NULL;
+static pthread_once_t wq_once = PTHREAD_ONCE_INIT;
+
+static inline bool wq_overlap(const struct wq_entry *e, off64_t offset, size_t len) {
+  return e->offset < offset + (off64_t) len && offset < e->offset + (off64_t) e->len;
+}
+
+/* oldest entry that can be written now, called locked */
+struct wq_entry *wq_pick(struct wqueue *q) {
+struct wq_entry *e, *o;
+
+  for (e = q->head; e != NULL; e = e->next) {
+    if (e->busy)
+      continue;
+
+    if (e->blocked) {
+      for (o = q->head; o != e; o = o->next) {
+        if (wq_overlap(o, e->offset, e->len))
+          break;
+      }
+      if (o != e)
+        continue;
+      e->blocked = false;
+    }
+
+    return e;
+  }
+
+  return NULL;
+}
+
+void *wq_thread(void *arg) {
+struct wqueue *q = arg;
+struct wq_entry *e, *o, *prev;
+size_t done;
+ssize_t res;
+
+  pthread_mutex_lock(&q->lock);
+  for (;;) {
+    e = wq_pick(q);
+    if (e == NULL) {
+      pthread_cond_wait(&q->work, &q->lock);
+      continue;
+    }
+
+    e->busy = true;
+    pthread_mutex_unlock(&q->lock);
+
+    for (done = 0; done < e->len; done += res) {
+      res = p_pwrite64(q->fd, e->data + done, e->len - done, q->base + e->offset + done);
+      if (res <= 0)
+        break;
+    }
+
+    pthread_mutex_lock(&q->lock);
+    if (done < e->len && q->error == 0)
+      q->error = res < 0 ? errno : EIO;
+
+    for (prev = NULL, o = q->head; o != e; prev = o, o = o->next)
+      ;
+    if (prev != NULL)
+      prev->next = e->next;
+    else
+      q->head = e->next;
+    if (q->tail == e)
+      q->tail = prev;
+
+    q->used -= e->len;
+    free(e);
+
+    /* a blocked entry may be free now */
+    pthread_cond_broadcast(&q->work);
+    pthread_cond_broadcast(&q->done);
+  }
+
+  return NULL;
+}
+
+/* number of writer threads started */
+int wq_start(struct wqueue *q, int threads) {
+pthread_t tid;
+int i;
+
+  for (i = 0; i < threads; i++) {
+    if (pthread_create(&tid, NULL, wq_thread, q) != 0)
+      break;
+    pthread_detach(tid);
+  }
+
+  return i;
+}
+
+/* writer threads are not inherited by fork, so queues are emptied
+   and held locked across it and child starts its own threads */
+static void wq_prefork(void) {
+struct wqueue *q;
+
+  for (q = wq_list; q != NULL; q = q->next) {
+    pthread_mutex_lock(&q->lock);
+    while (q->head != NULL)
+      pthread_cond_wait(&q->done, &q->lock);
+  }
+}
+
+static void wq_parent(void) {
+struct wqueue *q;
+
+  for (q = wq_list; q != NULL; q = q->next)
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void wq_child(void) {
+struct wqueue *q;
+
+  for (q = wq_list; q != NULL; q = q->next) {
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->work, NULL);
+    pthread_cond_init(&q->done, NULL);
+    q->threads = wq_start(q, q->threads);
+    if (q->threads == 0)
+      dprint(LOG_ERR, true, "fawrap.so no writer thread after fork");
+  }
+}
+
+static void wq_atfork(void) {
+  pthread_atfork(wq_prefork, wq_parent, wq_child);
+}
+
+bool wq_init(struct wqueue *q, int fd, off64_t base, size_t limit, int threads) {
+  memset(q, 0, sizeof(*q));
+  q->fd = fd;
+  q->base = base;
+  q->limit = limit;
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->work, NULL);
+  pthread_cond_init(&q->done, NULL);
+
+  q->threads = wq_start(q, threads);
+  if (q->threads == 0)
+    return true;
+
+  pthread_once(&wq_once, wq_atfork);
+  q->next = wq_list;
+  wq_list = q;
+  return false;
+}
+
+/* first error of queued writes, cleared when reported */
+int wq_error(struct wqueue *q) {
+int err;
+
+  pthread_mutex_lock(&q->lock);
+  err = q->error;
+  q->error = 0;
+  pthread_mutex_unlock(&q->lock);
+
+  if (err == 0)
+    return 0;
+
+  errno = err;
+  return -1;
+}
+
+/* wait until all queued writes are done */
+int wq_barrier(struct wqueue *q) {
+  pthread_mutex_lock(&q->lock);
+  while (q->head != NULL)
+    pthread_cond_wait(&q->done, &q->lock);
+  pthread_mutex_unlock(&q->lock);
+
+  return wq_error(q);
+}
+
+ssize_t wq_write(struct wqueue *q, const void *buf, size_t len, off64_t offset) {
+struct wq_entry *e, *o;
+
+  if (len == 0)
+    return 0;
+
+  /* too big for arena or no writer, written in place after older writes */
+  if (len > q->limit / 2 || q->threads == 0) {
+    if (wq_barrier(q) != 0)
+      return -1;
+    return p_pwrite64(q->fd, buf, len, q->base + offset);
+  }
+
+  pthread_mutex_lock(&q->lock);
+  if (q->error != 0) {
+    errno = q->error;
+    q->error = 0;
+    pthread_mutex_unlock(&q->lock);
+    return -1;
+  }
+
+  /* rewrite of a waiting entry is merged into it */
+  for (o = q->head; o != NULL; o = o->next) {
+    if (! o->busy && ! o->blocked && o->offset <= offset && \
+        offset + (off64_t) len <= o->offset + (off64_t) o->len) {
+      for (e = o->next; e != NULL; e = e->next) {
+        if (wq_overlap(e, offset, len))
+          break;
+      }
+      if (e == NULL) {
+        memcpy(o->data + (offset - o->offset), buf, len);
+        q->writes++;
+        pthread_mutex_unlock(&q->lock);
+        return len;
+      }
+    }
+  }
+
+  if (q->used + len > q->limit)
+    q->stalls++;
+  while (q->used + len > q->limit)
+    pthread_cond_wait(&q->done, &q->lock);
+
+  e = malloc(sizeof(*e) + len);
+  if (e == NULL) {
+    pthread_mutex_unlock(&q->lock);
+    if (wq_barrier(q) != 0)
+      return -1;
+    return p_pwrite64(q->fd, buf, len, q->base + offset);
+  }
+
+  e->offset = offset;
+  e->len = len;
+  e->busy = false;
+  e->blocked = false;
+  e->next = NULL;
+  memcpy(e->data, buf, len);
+
+  for (o = q->head; o != NULL; o = o->next) {
+    if (wq_overlap(o, offset, len)) {
+      e->blocked = true;
+      break;
+    }
+  }
+
+  if (q->tail != NULL)
+    q->tail->next = e;
+  else
+    q->head = e;
+  q->tail = e;
+  q->used += len;
+  q->writes++;
+
+  pthread_cond_signal(&q->work);
+  pthread_mutex_unlock(&q->lock);
+  return len;
+}
+
+/* read through queue: disk data with queued writes applied on top */
+ssize_t wq_read(struct wqueue *q, int fd, void *buf, size_t len, off64_t offset) {
+struct wq_entry *e;
+off64_t from, to;
+ssize_t res;
+
+  pthread_mutex_lock(&q->lock);
+  for (e = q->head; e != NULL; e = e->next) {
+    if (wq_overlap(e, offset, len))
+      break;
+  }
+
+  if (e == NULL) {
+    pthread_mutex_unlock(&q->lock);
+    return p_pread64(fd, buf, len, q->base + offset);
+  }
+
+  /* entries can't leave queue while locked, so each one is
+     either on disk already or applied below */
+  res = p_pread64(fd, buf, len, q->base + offset);
+  if (res >= 0) {
+    /* staged data past end of file counts as read */
+    for (e = q->head; e != NULL; e = e->next) {
+      if (! wq_overlap(e, offset, len))
+        continue;
+
+      from = e->offset > offset ? e->offset : offset;
+      to = e->offset + (off64_t) e->len < offset + (off64_t) len ? \
+        e->offset + (off64_t) e->len : offset + (off64_t) len;
+      if (from > offset + res)
+        memset((char *) buf + res, 0, from - offset - res);
+      memcpy((char *) buf + (from - offset), e->data + (from - e->offset), to - from);
+      if (to - offset > res)
+        res = to - offset;
+    }
+  }
+
+  pthread_mutex_unlock(&q->lock);
+  return res;
+}
+
+/* write-behind engine on top of a write queue to own fd */
+static off64_t wb_arena = 64 << 20;
+static int wb_fd = -1;
+static struct wqueue wb_queue;
+
+bool wb_init(void) {
+  wb_fd = p_open64(target_name, O_RDWR);
+  if (wb_fd < 0) {
+    dprint(LOG_ERR, true, "fawrap.so can't open %s", target_name);
+    return true;
+  }
+
+  return wq_init(&wb_queue, wb_fd, segment_offset, wb_arena, pool_threads());
+}
+
+ssize_t wb_pread(int fd, void *buf, size_t count, off64_t offset) {
+  if (wq_error(&wb_queue) != 0)
+    return -1;
+
+  return wq_read(&wb_queue, wb_fd, buf, count, offset);
+}
+
+ssize_t wb_pwrite(int fd, const void *buf, size_t count, off64_t offset) {
+  return wq_write(&wb_queue, buf, count, offset);
+}
+
+int wb_fallocate(int fd, int mode, off64_t offset, off64_t len) {
+  if (wq_barrier(&wb_queue) != 0)
+    return -1;
+
+  return p_fallocate64(wb_fd, mode, segment_offset + offset, len);
+}
+
+int wb_flush(int fd, bool data_only) {
+  if (wq_barrier(&wb_queue) != 0)
+    return -1;
+
+  return data_only ? p_fdatasync(wb_fd) : p_fsync(wb_fd);
+}
+
+int wb_close(int fd) {
+  return wq_barrier(&wb_queue);
+}
+
+void wb_fini(void) {
+  if (wq_barrier(&wb_queue) != 0)
+    dprint(LOG_ERR, true, "fawrap.so write behind failed: %s", strerror(errno));
+
+  report("write behind writes %llu, stalls on full arena %llu", \
+    wb_queue.writes, wb_queue.stalls);
+  p_close(wb_fd);
+}
+
+static const struct engine wb_engine = {
+  .name = "writebehind",
+  .init = wb_init,
+  .pread = wb_pread,
+  .pwrite = wb_pwrite,
+  .fallocate = wb_fallocate,
+  .flush = wb_flush,
+  .close = wb_close,
+  .fini = wb_fini,
+};
+
+/* mirrors: writes and fallocate of the segment are repeated to other
+   images or devices, each at its own offset, by a writer thread per
+   mirror through a write-behind queue; reads come from the target,
+   flushes and close of target wait for mirrors */
+#define MIRROR_MAX 16
+#define MIRROR_ARENA (32 << 20)
+
+struct mirror {
+  char *name;
+  off64_t offset;
+  int fd;
+  struct wqueue queue;
+};
+
+static struct mirror mirrors[MIRROR_MAX];
+static int mirror_count = 0;
+
+/* file[@offset]+file[@offset]..., offset defaults to segment offset */
+bool mirror_parse(char *val) {
+char *name, *at;
+
+  for (name = strtok_r(val, "+", &val); name != NULL; name = strtok_r(NULL, "+", &val)) {
+    if (mirror_count == MIRROR_MAX)
+      return true;
+
+    at = strchr(name, '@');
+    if (at != NULL)
+      *at++ = '\0';
+    mirrors[mirror_count].name = name;
+    mirrors[mirror_count].offset = at != NULL ? strtoll(at, NULL, 10) : -1;
+    mirror_count++;
+  }
+
+  return mirror_count == 0;
+}
+
+bool mirror_init(void) {
+struct mirror *m;
+struct stat64 st;
+int i;
+
+  for (i = 0; i < mirror_count; i++) {
+    m = &mirrors[i];
+    if (m->offset < 0)
+      m->offset = segment_offset;
+
+    m->fd = p_open64(m->name, O_RDWR | O_CREAT, 0644);
+    if (m->fd < 0) {
+      dprint(LOG_ERR, true, "fawrap.so can't open %s", m->name);
+      return true;
+    }
+
+    /* image copies get whole segment even if its end is never written */
+    if (real_fstat64(m->fd, &st) != 0 || (S_ISREG(st.st_mode) && \
+        st.st_size < m->offset + segment_len && \
+        p_ftruncate64(m->fd, m->offset + segment_len) != 0))
+      return true;
+
+    if (wq_init(&m->queue, m->fd, m->offset, MIRROR_ARENA, 1))
+      return true;
+
+    dprint(LOG_INFO, true, "fawrap.so      mirror: %s@%llu", m->name, m->offset);
+  }
+
+  return false;
+}
+
+/* first error of any mirror */
+int mirror_error(void) {
+int i;
+
+  for (i = 0; i < mirror_count; i++) {
+    if (wq_error(&mirrors[i].queue) != 0)
+      return -1;
+  }
+
+  return 0;
+}
+
+int mirror_write(const void *buf, size_t count, off64_t offset) {
+int i;
+
+  for (i = 0; i < mirror_count; i++) {
+    if (wq_write(&mirrors[i].queue, buf, count, offset) < 0)
+      return -1;
+  }
+
+  return 0;
+}
+
+int mirror_barrier(void) {
+int i, res = 0;
+
+  for (i = 0; i < mirror_count; i++) {
+    if (wq_barrier(&mirrors[i].queue) != 0)
+      res = -1;
+  }
+
+  return res;
+}
+
+/* devices may not punch holes, zeros are written then */
+int mirror_zero(int fd, off64_t offset, off64_t len) {
+static char zeros[1 << 20];
+off64_t part;
+
+  if (p_fallocate64(fd, FALLOC_FL_ZERO_RANGE, offset, len) == 0)
+    return 0;
+
+  for (; len > 0; offset += part, len -= part) {
+    part = len < (off64_t) sizeof(zeros) ? len : (off64_t) sizeof(zeros);
+    if (p_pwrite64(fd, zeros, part, offset) != part)
+      return -1;
+  }
+
+  return 0;
+}
+
+int mirror_fallocate(int mode, off64_t offset, off64_t len) {
+struct mirror *m;
+int i;
+
+  if (mirror_barrier() != 0)
+    return -1;
+
+  for (i = 0; i < mirror_count; i++) {
+    m = &mirrors[i];
+    if (p_fallocate64(m->fd, mode, m->offset + offset, len) == 0)
+      continue;
+    if (! (errno == EOPNOTSUPP || errno == ENODEV))
+      return -1;
+
+    /* plain allocation is only a hint to a mirror, zeroing is not */
+    if ((mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) && \
+        mirror_zero(m->fd, m->offset + offset, len) != 0)
+      return -1;
+  }
+
+  return 0;
+}
+
+int mirror_flush(bool data_only) {
+int i, res;
+
+  res = mirror_barrier();
+  for (i = 0; i < mirror_count; i++) {
+    if ((data_only ? p_fdatasync(mirrors[i].fd) : p_fsync(mirrors[i].fd)) != 0)
+      res = -1;
+  }
+
+  return res;
+}
+
+void mirror_fini(void) {
+unsigned long long writes = 0, stalls = 0;
+int i;
+
+  if (mirror_flush(false) != 0)
+    dprint(LOG_ERR, true, "fawrap.so mirror write failed: %s", strerror(errno));
+
+  for (i = 0; i < mirror_count; i++) {
+    writes += mirrors[i].queue.writes;
+    stalls += mirrors[i].queue.stalls;
+    p_close(mirrors[i].fd);
+  }
+
+  report("mirrors %d, writes %llu, stalls on full arena %llu", \
+    mirror_count, writes, stalls);
+}
+
+/* extent table: segment is a virtual file stitched from extents of
+   backing files, described dm-style one per line in sectors
+     start len linear file offset
+     start len striped stripes chunk file offset [file offset ...]
+     start len zero
+   extents follow each other from 0, a lookup is a binary search;
+   requests are split at extent and chunk boundaries and pieces on
+   different stripes are issued in parallel; linear is one stripe */
+#define MAP_SECTOR 512
+#define MAP_FILES 64
+#define MAP_STRIPES 32
+#define MAP_LINE (MAP_STRIPES * (PATH_MAX + 32))   /* longest table line, on heap */
+#define MAP_DATA 0
+#define MAP_ZERO 1
+
+struct map_target {
+  int file;         /* index to map_fd */
+  off64_t offset;   /* in file */
+};
+
+struct map_extent {
+  off64_t start;    /* in segment, bytes */
+  off64_t len;
+  int type;
+  int stripes;
+  off64_t chunk;    /* bytes, extent length if linear */
+  struct map_target *target;
+};
+
+/* part of a request inside one chunk of one file */
+struct map_piece {
+  int fd;           /* -1 for zero extent */
+  char *buf;
+  size_t len;
+  off64_t offset;
+  ssize_t res;
+  int err;
+};
+
+struct map_job {
+  struct map_piece *pieces;
+  bool write;
+};
+
+static char *map_name = NULL;
+static struct map_extent *map_table = NULL;
+static size_t map_count = 0;
+static int map_fd[MAP_FILES];
+static int map_files = 0;
+static unsigned long long map_parallel = 0;
+
+/* same file named twice shares one fd */
+int map_open(const char *name) {
+static char *names[MAP_FILES];
+int i;
+
+  for (i = 0; i < map_files; i++) {
+    if (strcmp(names[i], name) == 0)
+      return i;
+  }
+
+  if (map_files == MAP_FILES)
+    return -1;
+
+  map_fd[map_files] = p_open64(name, O_RDWR);
+  if (map_fd[map_files] < 0 && errno == EACCES)
+    map_fd[map_files] = p_open64(name, O_RDONLY);
+  if (map_fd[map_files] < 0) {
+    dprint(LOG_ERR, true, "fawrap.so can't open %s", name);
+    return -1;
+  }
+
+  names[map_files] = strdup(name);
+  return map_files++;
+}
+
+/* "file offset" pairs after type and its arguments */
+bool map_targets(struct map_extent *e, char *args) {
+char file[PATH_MAX];
+unsigned long long offset;
+int i, n;
+
+  e->target = malloc(e->stripes * sizeof(*e->target));
+  if (e->target == NULL)
+    return true;
+
+  for (i = 0; i < e->stripes; i++) {
+    if (sscanf(args, "%4095s %llu%n", file, &offset, &n) != 2)
+      return true;
+    args += n;
+
+    e->target[i].file = map_open(file);
+    e->target[i].offset = offset * MAP_SECTOR;
+    if (e->target[i].file < 0)
+      return true;
+  }
+
+  return false;
+}
+
+bool map_init(void) {
+struct map_extent *e;
+unsigned long long start, len, chunk;
+char *line;
+char type[16];
+char *args;
+off64_t end = 0;
+size_t size = 0;
+int lineno = 0;
+int n, stripes;
+FILE *f;
+
+  f = fopen(map_name, "r");
+  line = malloc(MAP_LINE);
+  if (f == NULL || line == NULL) {
+    dprint(LOG_ERR, true, "fawrap.so can't open %s", map_name);
+    if (f != NULL)
+      fclose(f);
+    free(line);
+    return true;
+  }
+
+  while (fgets(line, MAP_LINE, f) != NULL) {
+    lineno++;
+    if (line[strspn(line, " \t")] == '#' || line[strspn(line, " \t\r\n")] == '\0')
+      continue;
+
+    if (map_count == size) {
+      size = size ? size * 2 : 64;
+      e = realloc(map_table, size * sizeof(*map_table));
+      if (e == NULL)
+        break;
+      map_table = e;
+    }
+    e = &map_table[map_count];
+
+    if (sscanf(line, "%llu %llu %15s%n", &start, &len, type, &n) != 3 || \
+        (off64_t) (start * MAP_SECTOR) != end || len == 0) {
+      dprint(LOG_ERR, true, "fawrap.so %s:%d: bad or not contiguous extent", \
+        map_name, lineno);
+      break;
+    }
+
+    e->start = start * MAP_SECTOR;
+    e->len = len * MAP_SECTOR;
+    e->type = MAP_DATA;
+    e->stripes = 1;
+    e->chunk = e->len;
+    e->target = NULL;
+
+    args = line + n;
+    if (strcmp(type, "striped") == 0) {
+      if (sscanf(args, "%d %llu%n", &stripes, &chunk, &n) != 2 || \
+          stripes < 1 || stripes > MAP_STRIPES || chunk == 0 || \
+          len % (stripes * chunk) != 0)
+        stripes = 0;
+      e->stripes = stripes;
+      e->chunk = chunk * MAP_SECTOR;
+      args += n;
+    }
+
+    if (strcmp(type, "zero") == 0)
+      e->type = MAP_ZERO;
+    else if ((strcmp(type, "linear") != 0 && strcmp(type, "striped") != 0) || \
+        e->stripes == 0 || map_targets(e, args)) {
+      dprint(LOG_ERR, true, "fawrap.so %s:%d: bad extent", map_name, lineno);
+      break;
+    }
+
+    end += e->len;
+    map_count++;
+  }
+
+  free(line);
+  if (! feof(f) || map_count == 0) {
+    fclose(f);
+    return true;
+  }
+  fclose(f);
+
+  /* length 0 in FILE takes whole table */
+  if (segment_len == 0)
+    segment_len = end;
+  if (segment_len > end) {
+    dprint(LOG_ERR, true, "fawrap.so segment is longer than %s", map_name);
+    return true;
+  }
+
+  dprint(LOG_INFO, true, "fawrap.so map %s: %zu extents, %d files", map_name, \
+    map_count, map_files);
+  return false;
+}
+
+/* extent holding offset, which is inside segment */
+struct map_extent *map_find(off64_t offset) {
+size_t lo = 0, hi = map_count, mid;
+
+  while (hi - lo > 1) {
+    mid = (lo + hi) / 2;
+    if (map_table[mid].start <= offset)
+      lo = mid;
+    else
+      hi = mid;
+  }
+
+  return &map_table[lo];
+}
+
+/* where offset of segment lives, len is clipped to end of its chunk */
+void map_locate(off64_t offset, off64_t *len, int *fd, off64_t *file_offset) {
+struct map_extent *e = map_find(offset);
+off64_t rel = offset - e->start;
+off64_t chunk = rel / e->chunk;
+int stripe = chunk % e->stripes;
+
+  if (*len > e->chunk - rel % e->chunk)
+    *len = e->chunk - rel % e->chunk;
+
+  if (e->type == MAP_ZERO) {
+    *fd = -1;
+    return;
+  }
+
+  *fd = map_fd[e->target[stripe].file];
+  *file_offset = e->target[stripe].offset + (chunk / e->stripes) * e->chunk + rel % e->chunk;
+}
+
+void map_piece_io(struct map_piece *p, bool write) {
+  if (p->fd < 0) {
+    /* like dm-zero: reads give zeros, writes are dropped */
+    if (! write)
+      memset(p->buf, 0, p->len);
+    p->res = p->len;
+  } else if (write)
+    p->res = p_pwrite64(p->fd, p->buf, p->len, p->offset);
+  else
+    p->res = p_pread64(p->fd, p->buf, p->len, p->offset);
+  p->err = errno;
+}
+
+void map_item(size_t item, void *ctx) {
+struct map_job *job = ctx;
+
+  map_piece_io(&job->pieces[item], job->write);
+}
+
+ssize_t map_io(char *buf, size_t count, off64_t offset, bool write) {
+struct map_piece one, *pieces = &one, *grown;
+struct map_job job;
+size_t n = 0, size = 1, done, i;
+off64_t len;
+ssize_t total = 0;
+
+  for (done = 0; done < count; done += len) {
+    if (n == size) {
+      size *= 4;
+      grown = realloc(pieces == &one ? NULL : pieces, size * sizeof(*pieces));
+      if (grown == NULL) {
+        total = -1;
+        errno = ENOMEM;
+        goto out;
+      }
+      if (pieces == &one)
+        grown[0] = one;
+      pieces = grown;
+    }
+
+    len = count - done;
+    map_locate(offset + done, &len, &pieces[n].fd, &pieces[n].offset);
+    pieces[n].buf = buf + done;
+    pieces[n].len = len;
+    n++;
+  }
+
+  job.pieces = pieces;
+  job.write = write;
+  if (n > 1) {
+    parallel_run(n, map_item, &job);
+    __atomic_fetch_add(&map_parallel, 1, __ATOMIC_RELAXED);
+  } else if (n == 1)
+    map_piece_io(pieces, write);
+
+  /* as if done by one call: bytes up to first short piece */
+  for (i = 0; i < n; i++) {
+    if (pieces[i].res < 0) {
+      if (total == 0) {
+        errno = pieces[i].err;
+        total = -1;
+      }
+      break;
+    }
+    total += pieces[i].res;
+    if ((size_t) pieces[i].res < pieces[i].len)
+      break;
+  }
+
+out:
+  if (pieces != &one)
+    free(pieces);
+  return total;
+}
+
+ssize_t map_pread(int fd, void *buf, size_t count, off64_t offset) {
+  return map_io(buf, count, offset, false);
+}
+
+ssize_t map_pwrite(int fd, const void *buf, size_t count, off64_t offset) {
+  return map_io((char *) buf, count, offset, true);
+}
+
+int map_fallocate(int fd, int mode, off64_t offset, off64_t len) {
+off64_t done, part, file_offset;
+int file;
+
+  for (done = 0; done < len; done += part) {
+    part = len - done;
+    map_locate(offset + done, &part, &file, &file_offset);
+    if (file >= 0 && p_fallocate64(file, mode, file_offset, part) != 0)
+      return -1;
+  }
+
+  return 0;
+}
+
+void map_prefetch(off64_t offset, off64_t len) {
+off64_t done, part, file_offset;
+int file;
+
+  for (done = 0; done < len; done += part) {
+    part = len - done;
+    map_locate(offset + done, &part, &file, &file_offset);
+    if (file >= 0)
+      readahead(file, file_offset, part);
+  }
+}
+
+int map_flush(int fd, bool data_only) {
+int i, res = 0;
+
+  for (i = 0; i < map_files; i++) {
+    if ((data_only ? p_fdatasync(map_fd[i]) : p_fsync(map_fd[i])) != 0)
+      res = -1;
+  }
+
+  return res;
+}
+
+void map_fini(void) {
+int i;
+
+  if (map_parallel > 0)
+    report("map parallel requests %llu", map_parallel);
+
+  for (i = 0; i < map_files; i++)
+    p_close(map_fd[i]);
+}
+
+static const struct engine map_engine = {
+  .name = "map",
+  .init = map_init,
+  .pread = map_pread,
+  .pwrite = map_pwrite,
+  .fallocate = map_fallocate,
+  .flush = map_flush,
+  .prefetch = map_prefetch,
+  .fini = map_fini,
+};
+
+/* qcow2 image as target, found by its magic: segment offset and
+   length are in guest disk coordinates; clusters are located through
+   L1 and L2 tables, recently used L2 tables are cached; a write to an
+   unallocated cluster appends a new one to image, sets its refcount
+   and only then points L2 entry to it; metadata is written through.
+   Without internal snapshots no cluster is shared, so allocated
+   clusters are written in place; images with snapshots are read only */
+#define QCOW_MAGIC 0x514649fb   /* "QFI\xfb" */
+#define QCOW_CACHE 64           /* L2 tables */
+#define QCOW_COPIED (1ULL << 63)
+#define QCOW_COMPRESSED (1ULL << 62)
+#define QCOW_ZERO 1ULL
+#define QCOW_OFFSET_MASK 0x00fffffffffffe00ULL
+
+struct qcow_l2 {
+  uint64_t offset;     /* of table in image, 0 - free slot */
+  uint64_t used;       /* LRU tick */
+  uint64_t *table;     /* big endian as in image */
+};
+
+static bool image_raw = false;      /* don't look for image formats */
+static int qcow_fd = -1;
+static bool qcow_readonly = false;
+static uint64_t qcow_autoclear = 0; /* feature bits left to clear */
+static int qcow_cluster_bits;
+static uint64_t qcow_cluster;
+static uint64_t qcow_size;          /* of guest disk */
+static uint64_t *qcow_l1 = NULL;    /* big endian */
+static uint32_t qcow_l1_size;
+static uint64_t qcow_l1_offset;
+static uint64_t *qcow_rt = NULL;    /* refcount table, big endian */
+static uint64_t qcow_rt_size;
+static uint64_t qcow_rt_offset;
+static uint16_t *qcow_rb = NULL;    /* last used refcount block */
+static uint64_t qcow_rb_offset = 0;
+static char *qcow_buf = NULL;       /* cluster being filled */
+static char *qcow_zeros = NULL;
+static uint64_t qcow_end;           /* where next cluster is appended */
+static struct qcow_l2 qcow_cache[QCOW_CACHE];
+static uint64_t qcow_tick = 0;
+static pthread_mutex_t qcow_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long long qcow_hits = 0;
+static unsigned long long qcow_misses = 0;
+static unsigned long long qcow_allocs = 0;
+
+static inline uint32_t qcow_be32(const unsigned char *p) {
+  return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static inline uint64_t qcow_be64(const unsigned char *p) {
+  return (uint64_t) qcow_be32(p) << 32 | qcow_be32(p + 4);
+}
+
+static inline size_t qcow_l1_index(uint64_t guest) {
+  return guest >> (2 * qcow_cluster_bits - 3);
+}
+
+static inline size_t qcow_l2_index(uint64_t guest) {
+  return (guest >> qcow_cluster_bits) & (qcow_cluster / 8 - 1);
+}
+
+/* whole buffer to image, true on error */
+bool qcow_write(const void *buf, size_t len, uint64_t offset) {
+ssize_t res = p_pwrite64(qcow_fd, buf, len, offset);
+
+  if (res != (ssize_t) len) {
+    if (res >= 0)
+      errno = EIO;
+    return true;
+  }
+
+  return false;
+}
+
+bool qcow_read(void *buf, size_t len, uint64_t offset) {
+ssize_t res = p_pread64(qcow_fd, buf, len, offset);
+
+  if (res != (ssize_t) len) {
+    if (res >= 0)
+      errno = EIO;
+    return true;
+  }
+
+  return false;
+}
+
+/* target starts with qcow2 magic */
+bool qcow_probe(void) {
+unsigned char magic[4];
+bool res;
+int fd;
+
+  fd = p_open64(target_name, O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  res = p_pread64(fd, magic, sizeof(magic), 0) == sizeof(magic) && \
+    qcow_be32(magic) == QCOW_MAGIC;
+  p_close(fd);
+  return res;
+}
+
+bool qcow_init(void) {
+unsigned char hdr[104];
+uint32_t version, refcount_order = 4;
+uint64_t incompat = 0;
+struct stat64 st;
+
+  qcow_fd = p_open64(target_name, O_RDWR);
+  if (qcow_fd < 0 && errno == EACCES) {
+    qcow_fd = p_open64(target_name, O_RDONLY);
+    qcow_readonly = true;
+  }
+  if (qcow_fd < 0 || real_fstat64(qcow_fd, &st) != 0 || qcow_read(hdr, sizeof(hdr), 0)) {
+    dprint(LOG_ERR, true, "fawrap.so can't read %s", target_name);
+    return true;
+  }
+
+  version = qcow_be32(hdr + 4);
+  if (version == 3) {
+    incompat = qcow_be64(hdr + 72);
+    qcow_autoclear = qcow_be64(hdr + 88);
+    refcount_order = qcow_be32(hdr + 96);
+  }
+  qcow_cluster_bits = qcow_be32(hdr + 20);
+  if ((version != 2 && version != 3) || qcow_cluster_bits < 9 || qcow_cluster_bits > 21) {
+    dprint(LOG_ERR, true, "fawrap.so unsupported qcow2 version %u", version);
+    return true;
+  }
+
+  if (qcow_be64(hdr + 8) != 0 || qcow_be32(hdr + 32) != 0 || incompat != 0 || \
+      refcount_order != 4) {
+    dprint(LOG_ERR, true, "fawrap.so qcow2 backing file, encryption, features 0x%llx " \
+      "or refcount width %u not supported", (unsigned long long) incompat, 1 << refcount_order);
+    return true;
+  }
+
+  qcow_cluster = 1ULL << qcow_cluster_bits;
+  qcow_size = qcow_be64(hdr + 24);
+  qcow_l1_size = qcow_be32(hdr + 36);
+  qcow_l1_offset = qcow_be64(hdr + 40);
+  qcow_rt_offset = qcow_be64(hdr + 48);
+  qcow_rt_size = qcow_be32(hdr + 56) * (qcow_cluster / 8);
+  if (qcow_be32(hdr + 60) > 0 && ! qcow_readonly) {
+    dprint(LOG_INFO, true, "fawrap.so qcow2 image has snapshots, read only");
+    qcow_readonly = true;
+  }
+
+  /* length 0 in FILE takes rest of guest disk */
+  if (segment_len == 0 && segment_offset < (off64_t) qcow_size)
+    segment_len = qcow_size - segment_offset;
+  if (segment_offset + segment_len > (off64_t) qcow_size || segment_len == 0) {
+    dprint(LOG_ERR, true, "fawrap.so segment past end of qcow2 disk (%llu bytes)", \
+      (unsigned long long) qcow_size);
+    return true;
+  }
+
+  qcow_l1 = malloc(qcow_l1_size * 8 + 8);
+  qcow_rt = malloc(qcow_rt_size * 8 + 8);
+  qcow_rb = malloc(qcow_cluster);
+  qcow_buf = malloc(qcow_cluster);
+  qcow_zeros = calloc(1, qcow_cluster);
+  if (qcow_l1 == NULL || qcow_rt == NULL || qcow_rb == NULL || qcow_buf == NULL || \
+      qcow_zeros == NULL || qcow_read(qcow_l1, qcow_l1_size * 8, qcow_l1_offset) || \
+      qcow_read(qcow_rt, qcow_rt_size * 8, qcow_rt_offset))
+    return true;
+
+  qcow_end = (st.st_size + qcow_cluster - 1) & ~(qcow_cluster - 1);
+
+  dprint(LOG_INFO, true, "fawrap.so qcow2 version %u: %llu bytes disk, %llu byte clusters", \
+    version, (unsigned long long) qcow_size, (unsigned long long) qcow_cluster);
+  return false;
+}
+
+/* L2 table at offset from cache, read on miss into least recently
+   used slot; a new table is only zeroed */
+uint64_t *qcow_table(uint64_t offset, bool load) {
+struct qcow_l2 *c, *victim = &qcow_cache[0];
+int i;
+
+  for (i = 0; i < QCOW_CACHE; i++) {
+    c = &qcow_cache[i];
+    if (c->offset == offset && load) {
+      c->used = ++qcow_tick;
+      qcow_hits++;
+      return c->table;
+    }
+    if (c->used < victim->used)
+      victim = c;
+  }
+
+  victim->offset = 0;
+  victim->used = 0;
+  if (victim->table == NULL && (victim->table = malloc(qcow_cluster)) == NULL)
+    return NULL;
+
+  if (! load)
+    memset(victim->table, 0, qcow_cluster);
+  else if (qcow_read(victim->table, qcow_cluster, offset))
+    return NULL;
+  else
+    qcow_misses++;
+
+  victim->offset = offset;
+  victim->used = ++qcow_tick;
+  return victim->table;
+}
+
+/* set refcount of cluster at host, a missing refcount block is
+   appended and counts itself when it falls in its own range */
+bool qcow_refcount(uint64_t host, uint16_t count) {
+uint64_t per_block = qcow_cluster / 2;
+uint64_t cluster = host >> qcow_cluster_bits;
+uint64_t i = cluster / per_block;
+uint64_t block, self;
+
+  if (i >= qcow_rt_size) {
+    dprint(LOG_ERR, true, "fawrap.so qcow2 refcount table is full");
+    errno = ENOSPC;
+    return true;
+  }
+
+  block = be64toh(qcow_rt[i]) & ~511ULL;
+  if (block == 0) {
+    block = qcow_end;
+    qcow_end += qcow_cluster;
+    self = block >> qcow_cluster_bits;
+
+    memset(qcow_rb, 0, qcow_cluster);
+    if (self / per_block == i)
+      qcow_rb[self % per_block] = htobe16(1);
+    qcow_rb_offset = block;
+    if (qcow_write(qcow_rb, qcow_cluster, block))
+      return true;
+
+    qcow_rt[i] = htobe64(block);
+    if (qcow_write(&qcow_rt[i], 8, qcow_rt_offset + i * 8) || \
+        (self / per_block != i && qcow_refcount(block, 1)))
+      return true;
+  }
+
+  if (qcow_rb_offset != block) {
+    qcow_rb_offset = 0;
+    if (qcow_read(qcow_rb, qcow_cluster, block))
+      return true;
+    qcow_rb_offset = block;
+  }
+
+  qcow_rb[cluster % per_block] = htobe16(count);
+  return qcow_write(&qcow_rb[cluster % per_block], 2, block + (cluster % per_block) * 2);
+}
+
+/* new cluster at end of image, 0 on error */
+uint64_t qcow_alloc(void) {
+uint64_t host = qcow_end;
+
+  qcow_end += qcow_cluster;
+  if (qcow_refcount(host, 1))
+    return 0;
+
+  return host;
+}
+
+/* L2 table of guest offset, NULL with errno 0 when not allocated */
+uint64_t *qcow_l2(uint64_t guest, bool alloc) {
+size_t i = qcow_l1_index(guest);
+uint64_t *table;
+uint64_t l2;
+
+  if (i >= qcow_l1_size) {
+    errno = EIO;
+    return NULL;
+  }
+
+  l2 = be64toh(qcow_l1[i]) & QCOW_OFFSET_MASK;
+  if (l2 != 0)
+    return qcow_table(l2, true);
+
+  if (! alloc) {
+    errno = 0;
+    return NULL;
+  }
+
+  l2 = qcow_alloc();
+  if (l2 == 0 || (table = qcow_table(l2, false)) == NULL || \
+      qcow_write(table, qcow_cluster, l2))
+    return NULL;
+
+  qcow_l1[i] = htobe64(l2 | QCOW_COPIED);
+  if (qcow_write(&qcow_l1[i], 8, qcow_l1_offset + i * 8))
+    return NULL;
+
+  return table;
+}
+
+/* host offset of guest cluster, 0 when it reads as zeros */
+bool qcow_entry(uint64_t guest, uint64_t *host) {
+uint64_t *table = qcow_l2(guest, false);
+uint64_t entry;
+
+  if (table == NULL) {
+    *host = 0;
+    return errno != 0;
+  }
+
+  entry = be64toh(table[qcow_l2_index(guest)]);
+  if (entry & QCOW_COMPRESSED) {
+    dprint(LOG_ERR, true, "fawrap.so qcow2 compressed clusters not supported");
+    errno = EIO;
+    return true;
+  }
+
+  *host = entry & QCOW_ZERO ? 0 : entry & QCOW_OFFSET_MASK;
+  return false;
+}
+
+/* where guest offset lives and how far image continues contiguously
+   from there (or keeps reading as zeros, then 0 is returned) */
+int64_t qcow_find(uint64_t guest, uint64_t *len) {
+uint64_t in = guest & (qcow_cluster - 1);
+uint64_t want = *len + in, run = 0;
+uint64_t host, first = 0;
+
+  pthread_mutex_lock(&qcow_lock);
+  while (run < want) {
+    if (qcow_entry(guest - in + run, &host)) {
+      if (run == 0) {
+        pthread_mutex_unlock(&qcow_lock);
+        return -1;
+      }
+      break;
+    }
+
+    if (run == 0)
+      first = host;
+    else if ((first == 0) != (host == 0) || (host != 0 && host != first + run))
+      break;
+    run += qcow_cluster;
+  }
+  pthread_mutex_unlock(&qcow_lock);
+
+  if (run > want)
+    run = want;
+  *len = run - in;
+  return first == 0 ? 0 : (int64_t) (first + in);
+}
+
+/* write into one cluster that reads as zeros, rest of it is zeroed */
+bool qcow_fill(const char *buf, size_t len, uint64_t guest) {
+uint64_t in = guest & (qcow_cluster - 1);
+size_t idx = qcow_l2_index(guest);
+uint64_t *table, entry, host, l2;
+bool err = true;
+
+  pthread_mutex_lock(&qcow_lock);
+  table = qcow_l2(guest, true);
+  if (table == NULL)
+    goto out;
+
+  entry = be64toh(table[idx]);
+  host = entry & QCOW_OFFSET_MASK;
+  if (entry & QCOW_COMPRESSED) {
+    dprint(LOG_ERR, true, "fawrap.so qcow2 compressed clusters not supported");
+    errno = EIO;
+    goto out;
+  }
+
+  /* allocated by another thread meanwhile */
+  if (host != 0 && ! (entry & QCOW_ZERO)) {
+    err = qcow_write(buf, len, host + in);
+    goto out;
+  }
+
+  /* zero flagged cluster may keep its preallocated space */
+  if (host == 0) {
+    host = qcow_alloc();
+    if (host == 0)
+      goto out;
+    qcow_allocs++;
+  }
+
+  if (len < qcow_cluster) {
+    memset(qcow_buf, 0, qcow_cluster);
+    memcpy(qcow_buf + in, buf, len);
+    buf = qcow_buf;
+    len = qcow_cluster;
+    in = 0;
+  }
+
+  if (qcow_write(buf, len, host + in))
+    goto out;
+
+  l2 = be64toh(qcow_l1[qcow_l1_index(guest)]) & QCOW_OFFSET_MASK;
+  table[idx] = htobe64(host | QCOW_COPIED);
+  err = qcow_write(&table[idx], 8, l2 + idx * 8);
+
+out:
+  pthread_mutex_unlock(&qcow_lock);
+  return err;
+}
+
+/* whole cluster is dropped from L2 table and punched in image */
+bool qcow_discard(uint64_t guest) {
+size_t idx = qcow_l2_index(guest);
+uint64_t *table, entry, host, l2;
+bool err = true;
+
+  pthread_mutex_lock(&qcow_lock);
+  table = qcow_l2(guest, false);
+  if (table == NULL) {
+    err = errno != 0;
+    goto out;
+  }
+
+  entry = be64toh(table[idx]);
+  if (entry == 0) {
+    err = false;
+    goto out;
+  }
+
+  l2 = be64toh(qcow_l1[qcow_l1_index(guest)]) & QCOW_OFFSET_MASK;
+  table[idx] = 0;
+  if (qcow_write(&table[idx], 8, l2 + idx * 8))
+    goto out;
+
+  /* compressed clusters share host clusters, they are left counted */
+  host = entry & QCOW_OFFSET_MASK;
+  err = false;
+  if (! (entry & QCOW_COMPRESSED) && host != 0) {
+    err = qcow_refcount(host, 0);
+    p_fallocate64(qcow_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, host, qcow_cluster);
+  }
+
+out:
+  pthread_mutex_unlock(&qcow_lock);
+  return err;
+}
+
+ssize_t qcow_pread(int fd, void *buf, size_t count, off64_t offset) {
+uint64_t len;
+size_t done;
+int64_t host;
+ssize_t res;
+
+  for (done = 0; done < count; done += len) {
+    len = count - done;
+    host = qcow_find(segment_offset + offset + done, &len);
+    if (host < 0)
+      return done > 0 ? (ssize_t) done : -1;
+
+    if (host == 0) {
+      memset((char *) buf + done, 0, len);
+      continue;
+    }
+
+    /* image may end inside its last cluster */
+    res = p_pread64(qcow_fd, (char *) buf + done, len, host);
+    if (res < 0)
+      return done > 0 ? (ssize_t) done : -1;
+    memset((char *) buf + done + res, 0, len - res);
+  }
+
+  return count;
+}
+
+/* a writer that doesn't know autoclear features must clear them,
+   done at first change so readers leave bitmaps of qemu valid */
+bool qcow_modify(void) {
+static const char zero[8];
+bool err = false;
+
+  if (qcow_readonly) {
+    errno = EROFS;
+    return true;
+  }
+
+  if (__atomic_load_n(&qcow_autoclear, __ATOMIC_ACQUIRE) == 0)
+    return false;
+
+  pthread_mutex_lock(&qcow_lock);
+  if (qcow_autoclear != 0) {
+    err = qcow_write(zero, 8, 88);
+    if (! err)
+      __atomic_store_n(&qcow_autoclear, 0, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&qcow_lock);
+  return err;
+}
+
+ssize_t qcow_pwrite(int fd, const void *buf, size_t count, off64_t offset) {
+uint64_t guest, len;
+size_t done;
+int64_t host;
+
+  if (qcow_modify())
+    return -1;
+
+  for (done = 0; done < count; done += len) {
+    guest = segment_offset + offset + done;
+    len = count - done;
+    host = qcow_find(guest, &len);
+
+    if (host > 0) {
+      if (qcow_write((const char *) buf + done, len, host))
+        return done > 0 ? (ssize_t) done : -1;
+      continue;
+    }
+
+    if (len > qcow_cluster - (guest & (qcow_cluster - 1)))
+      len = qcow_cluster - (guest & (qcow_cluster - 1));
+    if (host < 0 || qcow_fill((const char *) buf + done, len, guest))
+      return done > 0 ? (ssize_t) done : -1;
+  }
+
+  return count;
+}
+
+/* zeros written over allocated parts of a range inside one cluster */
+bool qcow_zero_part(uint64_t guest, uint64_t len) {
+uint64_t done, part;
+int64_t host;
+
+  for (done = 0; done < len; done += part) {
+    part = len - done;
+    host = qcow_find(guest + done, &part);
+    if (host < 0 || (host > 0 && qcow_write(qcow_zeros, part, host)))
+      return true;
+  }
+
+  return false;
+}
+
+int qcow_fallocate(int fd, int mode, off64_t offset, off64_t len) {
+uint64_t guest = segment_offset + offset, end = guest + len;
+uint64_t first, last, c;
+
+  if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+    errno = EOPNOTSUPP;
+    return -1;
+  }
+
+  /* clusters are allocated on write */
+  if (! (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)))
+    return 0;
+
+  if (qcow_modify())
+    return -1;
+
+  /* last cluster of disk may be partial */
+  first = (guest + qcow_cluster - 1) & ~(qcow_cluster - 1);
+  last = end == qcow_size ? (end + qcow_cluster - 1) & ~(qcow_cluster - 1) : \
+    end & ~(qcow_cluster - 1);
+  if (first >= last)
+    return qcow_zero_part(guest, len) ? -1 : 0;
+
+  if (qcow_zero_part(guest, first - guest) || \
+      (end > last && qcow_zero_part(last, end - last)))
+    return -1;
+
+  for (c = first; c < last; c += qcow_cluster) {
+    if (qcow_discard(c))
+      return -1;
+  }
+
+  return 0;
+}
+
+void qcow_prefetch(off64_t offset, off64_t len) {
+uint64_t done, part;
+int64_t host;
+
+  for (done = 0; done < (uint64_t) len; done += part) {
+    part = len - done;
+    host = qcow_find(segment_offset + offset + done, &part);
+    if (host < 0)
+      break;
+    if (host > 0)
+      readahead(qcow_fd, host, part);
+  }
+}
+
+int qcow_flush(int fd, bool data_only) {
+  return data_only ? p_fdatasync(qcow_fd) : p_fsync(qcow_fd);
+}
+
+void qcow_fini(void) {
+  if (qcow_hits + qcow_misses > 0)
+    report("qcow2 L2 cache hits %llu, misses %llu, clusters allocated %llu", \
+    qcow_hits, qcow_misses, qcow_allocs);
+
+  p_close(qcow_fd);
+}
+
+static const struct engine qcow_engine = {
+  .name = "qcow2",
+  .init = qcow_init,
+  .pread = qcow_pread,
+  .pwrite = qcow_pwrite,
+  .fallocate = qcow_fallocate,
+  .flush = qcow_flush,
+  .prefetch = qcow_prefetch,
+  .fini = qcow_fini,
+};
+
+/* seekable zstd image as target, found by seek table at its end:
+   image is a row of independent zstd frames and a skippable frame
+   listing their sizes, so only frames holding the request are read
+   and decompressed; offset and length are in decompressed bytes.
+   libzstd is loaded only when such an image is met. Decompressed
+   frames are kept in a small LRU cache, frames a large read covers
+   whole are decompressed in parallel straight to caller's buffer */
+#define ZST_SEEK_MAGIC 0x8F92EAB1
+#define ZST_SKIP_MAGIC 0x184D2A5E
+#define ZST_FOOTER 9
+#define ZST_MAX_SLOTS 1024
+
+struct zst_slot {
+  int64_t frame;       /* -1 - free slot */
+  uint64_t used;       /* LRU tick */
+  int pins;
+  bool ready;
+  char *data;
+};
+
+struct zst_job {
+  char *buf;           /* caller's, for first frame */
+  off64_t offset;      /* of request in image */
+  size_t count;
+  size_t first;        /* frame */
+  int err;
+};
+
+static off64_t zst_budget = 64 << 20;
+static int zst_fd = -1;
+static size_t zst_frames = 0;
+static uint64_t *zst_coff = NULL;      /* compressed offset of frame, one more */
+static uint64_t *zst_doff = NULL;      /* decompressed offset of frame, one more */
+static uint64_t zst_max_frame = 0;
+static struct zst_slot *zst_cache = NULL;
+static size_t zst_slots = 0;
+static uint64_t zst_tick = 0;
+static pthread_mutex_t zst_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t zst_ready = PTHREAD_COND_INITIALIZER;
+static __thread void *zst_dctx = NULL;
+static unsigned long long zst_hits = 0;
+static unsigned long long zst_misses = 0;
+static unsigned long long zst_direct = 0;
+
+static void *(*zst_create)(void);
+static size_t (*zst_decompress)(void *dctx, void *dst, size_t dst_len, const void *src, size_t src_len);
+static void *(*zst_create_c)(void);
+static size_t (*zst_compress)(void *cctx, void *dst, size_t dst_len, const void *src, size_t src_len, int level);
+static size_t (*zst_bound)(size_t len);
+static unsigned (*zst_is_error)(size_t code);
+static const char *(*zst_error_name)(size_t code);
+
+/* libzstd functions, true on error */
+bool zst_load(void) {
+void *lib;
+
+  if (zst_is_error != NULL)
+    return false;
+
+  lib = dlopen("libzstd.so.1", RTLD_NOW | RTLD_LOCAL);
+  if (lib == NULL) {
+    dprint(LOG_ERR, true, "fawrap.so can't load libzstd.so.1");
+    return true;
+  }
+
+  zst_create = (void *(*)(void)) dlsym(lib, "ZSTD_createDCtx");
+  zst_decompress = (size_t (*)(void *, void *, size_t, const void *, size_t)) \
+    dlsym(lib, "ZSTD_decompressDCtx");
+  zst_create_c = (void *(*)(void)) dlsym(lib, "ZSTD_createCCtx");
+  zst_compress = (size_t (*)(void *, void *, size_t, const void *, size_t, int)) \
+    dlsym(lib, "ZSTD_compressCCtx");
+  zst_bound = (size_t (*)(size_t)) dlsym(lib, "ZSTD_compressBound");
+  zst_error_name = (const char *(*)(size_t)) dlsym(lib, "ZSTD_getErrorName");
+  if (zst_create == NULL || zst_decompress == NULL || zst_create_c == NULL || \
+      zst_compress == NULL || zst_bound == NULL || zst_error_name == NULL)
+    return true;
+
+  zst_is_error = (unsigned (*)(size_t)) dlsym(lib, "ZSTD_isError");
+  return zst_is_error == NULL;
+}
+
+/* target ends with seek table footer */
+bool zst_probe(void) {
+unsigned char footer[ZST_FOOTER];
+struct stat64 st;
+bool res = false;
+int fd;
+
+  fd = p_open64(target_name, O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  if (real_fstat64(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > ZST_FOOTER && \
+      p_pread64(fd, footer, ZST_FOOTER, st.st_size - ZST_FOOTER) == ZST_FOOTER)
+    res = get32(footer + 5) == ZST_SEEK_MAGIC;
+
+  p_close(fd);
+  return res;
+}
+
+bool zst_init(void) {
+unsigned char footer[ZST_FOOTER];
+unsigned char *table = NULL;
+size_t entry, table_len, i;
+struct stat64 st;
+
+  if (zst_load())
+    return true;
+
+  zst_fd = p_open64(target_name, O_RDONLY);
+  if (zst_fd < 0 || real_fstat64(zst_fd, &st) != 0 || \
+      p_pread64(zst_fd, footer, ZST_FOOTER, st.st_size - ZST_FOOTER) != ZST_FOOTER)
+    return true;
+
+  /* entries are compressed and decompressed size, maybe checksum */
+  zst_frames = get32(footer);
+  entry = footer[4] & 0x80 ? 12 : 8;
+  table_len = zst_frames * entry;
+  if (footer[4] & 0x7c || (off64_t) (table_len + ZST_FOOTER + 8) > st.st_size) {
+    dprint(LOG_ERR, true, "fawrap.so bad zstd seek table");
+    return true;
+  }
+
+  table = malloc(table_len + 8);
+  zst_coff = malloc((zst_frames + 1) * sizeof(*zst_coff));
+  zst_doff = malloc((zst_frames + 1) * sizeof(*zst_doff));
+  if (table == NULL || zst_coff == NULL || zst_doff == NULL || \
+      p_pread64(zst_fd, table, table_len + 8, st.st_size - ZST_FOOTER - table_len - 8) != \
+        (ssize_t) table_len + 8 || \
+      get32(table) != ZST_SKIP_MAGIC || get32(table + 4) != table_len + ZST_FOOTER) {
+    dprint(LOG_ERR, true, "fawrap.so bad zstd seek table");
+    free(table);
+    return true;
+  }
+
+  zst_coff[0] = zst_doff[0] = 0;
+  for (i = 0; i < zst_frames; i++) {
+    zst_coff[i + 1] = zst_coff[i] + get32(table + 8 + i * entry);
+    zst_doff[i + 1] = zst_doff[i] + get32(table + 8 + i * entry + 4);
+    if (zst_doff[i + 1] - zst_doff[i] > zst_max_frame)
+      zst_max_frame = zst_doff[i + 1] - zst_doff[i];
+  }
+  free(table);
+
+  if ((off64_t) zst_coff[zst_frames] > st.st_size) {
+    dprint(LOG_ERR, true, "fawrap.so zstd seek table past end of image");
+    return true;
+  }
+
+  /* length 0 in FILE takes rest of image */
+  if (segment_len == 0 && segment_offset < (off64_t) zst_doff[zst_frames])
+    segment_len = zst_doff[zst_frames] - segment_offset;
+  if (segment_offset + segment_len > (off64_t) zst_doff[zst_frames] || segment_len == 0) {
+    dprint(LOG_ERR, true, "fawrap.so segment past end of zstd image (%llu bytes)", \
+      (unsigned long long) zst_doff[zst_frames]);
+    return true;
+  }
+
+  zst_slots = zst_max_frame > 0 ? zst_budget / zst_max_frame : 0;
+  if (zst_slots < 2)
+    zst_slots = 2;
+  if (zst_slots > ZST_MAX_SLOTS)
+    zst_slots = ZST_MAX_SLOTS;
+  zst_cache = calloc(zst_slots, sizeof(*zst_cache));
+  if (zst_cache == NULL)
+    return true;
+  for (i = 0; i < zst_slots; i++)
+    zst_cache[i].frame = -1;
+
+  dprint(LOG_INFO, true, "fawrap.so zstd image: %llu bytes in %zu frames, %zu cached", \
+    (unsigned long long) zst_doff[zst_frames], zst_frames, zst_slots);
+  return false;
+}
+
+/* frame holding offset of image */
+size_t zst_find(uint64_t offset) {
+size_t lo = 0, hi = zst_frames, mid;
+
+  while (hi - lo > 1) {
+    mid = (lo + hi) / 2;
+    if (zst_doff[mid] <= offset)
+      lo = mid;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+/* whole frame into dst, true on error */
+bool zst_frame(size_t frame, char *dst) {
+size_t clen = zst_coff[frame + 1] - zst_coff[frame];
+size_t dlen = zst_doff[frame + 1] - zst_doff[frame];
+size_t res;
+char *src;
+
+  if (zst_dctx == NULL && (zst_dctx = zst_create()) == NULL) {
+    errno = ENOMEM;
+    return true;
+  }
+
+  src = malloc(clen);
+  if (src == NULL) {
+    errno = ENOMEM;
+    return true;
+  }
+
+  if (p_pread64(zst_fd, src, clen, zst_coff[frame]) != (ssize_t) clen) {
+    free(src);
+    errno = EIO;
+    return true;
+  }
+
+  res = zst_decompress(zst_dctx, dst, dlen, src, clen);
+  free(src);
+  if (zst_is_error(res) || res != dlen) {
+    dprint(LOG_ERR, true, "fawrap.so zstd frame %zu: %s", frame, \
+      zst_is_error(res) ? zst_error_name(res) : "wrong size");
+    errno = EIO;
+    return true;
+  }
+
+  return false;
+}
+
+/* cached frame, pinned until zst_release; NULL with errno 0 when
+   all slots are pinned by other threads */
+struct zst_slot *zst_get(size_t frame) {
+struct zst_slot *s, *victim = NULL;
+size_t i;
+bool err;
+
+  pthread_mutex_lock(&zst_lock);
+  for (;;) {
+    for (i = 0; i < zst_slots; i++) {
+      s = &zst_cache[i];
+      if (s->frame == (int64_t) frame)
+        break;
+    }
+    if (i == zst_slots)
+      break;
+
+    /* another thread is decompressing it */
+    if (! s->ready) {
+      pthread_cond_wait(&zst_ready, &zst_lock);
+      continue;
+    }
+
+    s->pins++;
+    s->used = ++zst_tick;
+    zst_hits++;
+    pthread_mutex_unlock(&zst_lock);
+    return s;
+  }
+
+  for (i = 0; i < zst_slots; i++) {
+    s = &zst_cache[i];
+    if (s->pins == 0 && (victim == NULL || s->used < victim->used))
+      victim = s;
+  }
+  if (victim == NULL || (victim->data == NULL && \
+      (victim->data = malloc(zst_max_frame)) == NULL)) {
+    pthread_mutex_unlock(&zst_lock);
+    errno = victim == NULL ? 0 : ENOMEM;
+    return NULL;
+  }
+
+  victim->frame = frame;
+  victim->ready = false;
+  victim->pins = 1;
+  victim->used = ++zst_tick;
+  zst_misses++;
+  pthread_mutex_unlock(&zst_lock);
+
+  err = zst_frame(frame, victim->data);
+
+  pthread_mutex_lock(&zst_lock);
+  victim->ready = true;
+  if (err) {
+    victim->frame = -1;
+    victim->pins = 0;
+    victim->used = 0;
+  }
+  pthread_cond_broadcast(&zst_ready);
+  pthread_mutex_unlock(&zst_lock);
+  return err ? NULL : victim;
+}
+
+void zst_release(struct zst_slot *s) {
+  pthread_mutex_lock(&zst_lock);
+  s->pins--;
+  pthread_mutex_unlock(&zst_lock);
+}
+
+/* part of one frame into buf */
+bool zst_copy(size_t frame, char *buf, uint64_t offset, size_t len) {
+struct zst_slot *s;
+char *tmp;
+bool err;
+
+  s = zst_get(frame);
+  if (s != NULL) {
+    memcpy(buf, s->data + (offset - zst_doff[frame]), len);
+    zst_release(s);
+    return false;
+  }
+  if (errno != 0)
+    return true;
+
+  /* no free slot, decompressed aside */
+  tmp = malloc(zst_doff[frame + 1] - zst_doff[frame]);
+  if (tmp == NULL) {
+    errno = ENOMEM;
+    return true;
+  }
+  err = zst_frame(frame, tmp);
+  if (! err)
+    memcpy(buf, tmp + (offset - zst_doff[frame]), len);
+  free(tmp);
+  return err;
+}
+
+/* one frame of a request, frames it covers whole skip the cache */
+void zst_item(size_t item, void *ctx) {
+struct zst_job *job = ctx;
+size_t frame = job->first + item;
+uint64_t start = zst_doff[frame], end = zst_doff[frame + 1];
+uint64_t from = start > (uint64_t) job->offset ? start : (uint64_t) job->offset;
+uint64_t to = end < job->offset + job->count ? end : job->offset + job->count;
+char *dst = job->buf + (from - job->offset);
+bool err;
+
+  if (from == start && to == end) {
+    err = zst_frame(frame, dst);
+    __atomic_fetch_add(&zst_direct, 1, __ATOMIC_RELAXED);
+  } else
+    err = zst_copy(frame, dst, from, to - from);
+
+  if (err)
+    __atomic_store_n(&job->err, errno, __ATOMIC_RELAXED);
+}
+
+ssize_t zst_pread(int fd, void *buf, size_t count, off64_t offset) {
+struct zst_job job = { buf, segment_offset + offset, count, 0, 0 };
+size_t last;
+
+  if (count == 0)
+    return 0;
+
+  job.first = zst_find(job.offset);
+  last = zst_find(job.offset + count - 1);
+  if (job.first == last) {
+    if (zst_copy(job.first, buf, job.offset, count))
+      return -1;
+    return count;
+  }
+
+  parallel_run(last - job.first + 1, zst_item, &job);
+  if (job.err != 0) {
+    errno = job.err;
+    return -1;
+  }
+
+  return count;
+}
+
+ssize_t zst_pwrite(int fd, const void *buf, size_t count, off64_t offset) {
+  errno = EROFS;
+  return -1;
+}
+
+int zst_fallocate(int fd, int mode, off64_t offset, off64_t len) {
+  errno = EROFS;
+  return -1;
+}
+
+int zst_flush(int fd, bool data_only) {
+  return 0;
+}
+
+/* frames are decompressed into cache */
+void zst_prefetch(off64_t offset, off64_t len) {
+size_t frame, last;
+struct zst_slot *s;
+
+  frame = zst_find(segment_offset + offset);
+  last = zst_find(segment_offset + offset + len - 1);
+  for (; frame <= last; frame++) {
+    s = zst_get(frame);
+    if (s == NULL)
+      break;
+    zst_release(s);
+  }
+}
+
+void zst_fini(void) {
+  if (zst_hits + zst_misses + zst_direct > 0)
+    report("zstd frames cached %llu, decompressed %llu, straight to caller %llu", \
+      zst_hits, zst_misses, zst_direct);
+
+  p_close(zst_fd);
+}
+
+static const struct engine zst_engine = {
+  .name = "zstd",
+  .init = zst_init,
+  .pread = zst_pread,
+  .pwrite = zst_pwrite,
+  .fallocate = zst_fallocate,
+  .flush = zst_flush,
+  .prefetch = zst_prefetch,
+  .fini = zst_fini,
+};
+
+/* fsync policy for target: pass every call, coalesce calls to one
+   flush per sync_ms, defer all of them to close of target, or
+   write back only segment range and leave metadata to close */
+#define SYNC_PASS     0
+#define SYNC_COALESCE 1
+#define SYNC_CLOSE    2
+#define SYNC_RANGE    3
+
+static int sync_policy = SYNC_PASS;
+static long sync_ms = 100;
+static bool sync_pending = false;
+static struct timespec sync_last;
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long long sync_calls = 0;
+static unsigned long long sync_flushes = 0;
+static unsigned long long sync_avoided = 0;
+static unsigned long long sync_ranges = 0;
+
+/* one flush of the target through engine */
+int sync_flush(int fd, bool data_only) {
+int res;
+
+  res = engine->flush(fd, data_only);
+  if (res == 0 && mirror_count > 0)
+    res = mirror_flush(data_only);
+  if (res == 0)
+    sync_pending = false;
+
+  clock_gettime(CLOCK_MONOTONIC, &sync_last);
+  sync_flushes++;
+  return res;
+}
+
+/* fsync/fdatasync on target, fd < 0 for sync and syncfs
+   which flush through flush_all when they are not skipped */
+int sync_target(int fd, bool data_only, int (*flush_all)(int), int arg) {
+struct timespec now;
+bool skip = false;
+long ms;
+int res = 0;
+
+  pthread_mutex_lock(&sync_lock);
+  sync_calls++;
+
+  if (sync_policy == SYNC_CLOSE) {
+    skip = true;
+  } else if (sync_policy == SYNC_COALESCE) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = (now.tv_sec - sync_last.tv_sec) * 1000 + \
+      (now.tv_nsec - sync_last.tv_nsec) / 1000000;
+    skip = sync_flushes > 0 && ms < sync_ms;
+  }
+
+  if (skip) {
+    sync_pending = true;
+    sync_avoided++;
+  } else if (fd >= 0 && sync_policy == SYNC_RANGE && engine == &direct_engine) {
+    /* other parts of image file are not waited for */
+    res = sync_file_range(fd, segment_offset, segment_len, \
+      SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    sync_pending = true;
+    sync_ranges++;
+  } else if (fd >= 0) {
+    res = sync_flush(fd, data_only);
+  } else {
+    res = flush_all(arg);
+    if (res == 0 && engine != &direct_engine)
+      res = engine->flush(-1, false);
+    if (res == 0 && mirror_count > 0)
+      res = mirror_flush(false);
+    sync_pending = false;
+    sync_flushes++;
+    clock_gettime(CLOCK_MONOTONIC, &sync_last);
+  }
+
+  pthread_mutex_unlock(&sync_lock);
+  return res;
+}
+
+/* group commit of skipped flushes, before target fd is closed */
+void sync_close(int fd) {
+  pthread_mutex_lock(&sync_lock);
+  if (sync_pending)
+    sync_flush(fd, false);
+  pthread_mutex_unlock(&sync_lock);
+}
+
+bool any_target_fd(void) {
+int i;
+
+  for (i = 0; i < MAX_FD; i++) {
+    if (target_fd[i].fd != -1)
+      return true;
+  }
+
+  return false;
+}
+
+int sync_all(int unused) {
+  p_sync();
+  return 0;
+}
+
+/* prefetch: ranges of segment are queued for a helper thread which
+   pulls them into page cache (or asks engine to) ahead of demand;
+   queue is small and full queue drops requests */
+#define PREFETCH_QUEUE 256
+
+static int prefetch_fd = -1;
+static off64_t prefetch_off[PREFETCH_QUEUE];
+static off64_t prefetch_len[PREFETCH_QUEUE];
+static unsigned prefetch_head = 0;
+static unsigned prefetch_tail = 0;
+static bool prefetch_started = false;
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long long prefetch_bytes = 0;
+static unsigned long long prefetch_dropped = 0;
+
+/* adaptive readahead of sequential target reads */
+static off64_t ra_max = 0;           /* 0 - disabled */
+#define RA_MIN (128 << 10)
+
+/* trace profile: blocks read, in order of first touch, are saved at
+   exit and replayed by prefetch thread at start of the next run */
+#define TRACE_MAGIC "FAWRAPPF"
+#define TRACE_BLOCK 4096
+
+static char *profile_name = NULL;
+static uint64_t trace_key = 0;     /* program, image, segment */
+static struct bitmap trace_seen;
+static uint32_t *trace_order = NULL;    /* blocks being recorded */
+static size_t trace_count = 0;
+static size_t trace_size = 0;
+static uint32_t *trace_replay = NULL;   /* blocks of previous run */
+static size_t trace_replay_count = 0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void prefetch_range(off64_t offset, off64_t len) {
+  if (engine->prefetch != NULL)
+    engine->prefetch(offset, len);
+  else
+    readahead(prefetch_fd, segment_offset + offset, len);
+}
+
+/* runs of consecutive blocks are prefetched at once */
+void trace_prefetch(void) {
+size_t i, run;
+
+  for (i = 0; i < trace_replay_count; i += run) {
+    for (run = 1; i + run < trace_replay_count && \
+        trace_replay[i + run] == trace_replay[i] + run; run++)
+      ;
+    prefetch_range((off64_t) trace_replay[i] * TRACE_BLOCK, \
+      (off64_t) run * TRACE_BLOCK);
+    __atomic_fetch_add(&prefetch_bytes, run * TRACE_BLOCK, __ATOMIC_RELAXED);
+  }
+}
+
+/* ext2/3/4 metadata prefetch: superblock at 1024 of segment tells
+   where group descriptors are, they tell where bitmaps and inode
+   tables are; ranges are merged and prefetched in parallel */
+#define EXT_MAGIC 0xEF53
+#define EXT_INCOMPAT_META_BG 0x0010
+#define EXT_INCOMPAT_64BIT 0x0080
+#define EXT_RO_COMPAT_GDT_CSUM 0x0010
+#define EXT_RO_COMPAT_METADATA_CSUM 0x0400
+#define EXT_BG_INODE_UNINIT 0x0001
+#define EXT_BG_BLOCK_UNINIT 0x0002
+
+struct ext_range {
+  off64_t offset;
+  off64_t len;
+};
+
+static bool ext_prefetch_on = false;
+static struct ext_range *ext_ranges = NULL;
+static size_t ext_count = 0;
+
+void ext_add(off64_t offset, off64_t len) {
+  if (offset >= segment_len || len <= 0)
+    return;
+  if (len > segment_len - offset)
+    len = segment_len - offset;
+
+  ext_ranges[ext_count].offset = offset;
+  ext_ranges[ext_count].len = len;
+  ext_count++;
+}
+
+static int ext_cmp(const void *a, const void *b) {
+const struct ext_range *x = a, *y = b;
+
+  return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/* sorted, touching ranges (flex_bg packs them) become one */
+void ext_merge(void) {
+size_t i, n = 0;
+
+  qsort(ext_ranges, ext_count, sizeof(*ext_ranges), ext_cmp);
+  for (i = 1; i < ext_count; i++) {
+    if (ext_ranges[i].offset <= ext_ranges[n].offset + ext_ranges[n].len) {
+      if (ext_ranges[i].offset + ext_ranges[i].len > ext_ranges[n].offset + ext_ranges[n].len)
+        ext_ranges[n].len = ext_ranges[i].offset + ext_ranges[i].len - ext_ranges[n].offset;
+    } else
+      ext_ranges[++n] = ext_ranges[i];
+  }
+  ext_count = ext_count ? n + 1 : 0;
+}
+
+/* metadata as tools see it, map has no single image
+   and qcow2 or zstd image is not laid out like the disk */
+static ssize_t ext_read(int fd, void *buf, size_t count, off64_t offset) {
+  if (engine == &map_engine || engine == &qcow_engine || engine == &zst_engine)
+    return engine->pread(fd, buf, count, offset);
+
+  return p_pread64(fd, buf, count, segment_offset + offset);
+}
+
+/* false also when segment holds no ext filesystem */
+bool ext_init(void) {
+unsigned char sb[1024];
+unsigned char *gdt, *desc;
+uint32_t block_size, blocks_per_group, inodes_per_group, inode_size;
+uint32_t desc_size, incompat, ro_compat, used;
+uint64_t blocks, groups, g;
+off64_t gdt_offset, gdt_len;
+bool csum;
+int fd;
+
+  fd = p_open64(target_name, O_RDONLY);
+  if (fd < 0)
+    return true;
+
+  if (segment_len < 2048 || \
+      ext_read(fd, sb, sizeof(sb), 1024) != sizeof(sb) || \
+      get16(sb + 56) != EXT_MAGIC || get32(sb + 24) > 6) {
+    dprint(LOG_INFO, true, "fawrap.so no ext superblock in segment");
+    p_close(fd);
+    return false;
+  }
+
+  block_size = 1024 << get32(sb + 24);
+  blocks_per_group = get32(sb + 32);
+  inodes_per_group = get32(sb + 40);
+  inode_size = get32(sb + 76) == 0 ? 128 : get16(sb + 88);
+  incompat = get32(sb + 96);
+  ro_compat = get32(sb + 100);
+  desc_size = incompat & EXT_INCOMPAT_64BIT ? get16(sb + 254) : 32;
+  blocks = get32(sb + 4);
+  if (incompat & EXT_INCOMPAT_64BIT)
+    blocks |= (uint64_t) get32(sb + 336) << 32;
+  csum = ro_compat & (EXT_RO_COMPAT_GDT_CSUM | EXT_RO_COMPAT_METADATA_CSUM);
+
+  if (blocks_per_group == 0 || desc_size < 32 || blocks <= get32(sb + 20)) {
+    p_close(fd);
+    return false;
+  }
+  groups = (blocks - get32(sb + 20) + blocks_per_group - 1) / blocks_per_group;
+
+  /* descriptors follow superblock, meta_bg scatters them */
+  gdt_offset = (off64_t) (get32(sb + 20) + 1) * block_size;
+  gdt_len = groups * desc_size;
+  if (incompat & EXT_INCOMPAT_META_BG || gdt_offset + gdt_len > segment_len) {
+    p_close(fd);
+    return false;
+  }
+
+  gdt = malloc(gdt_len);
+  ext_ranges = malloc((groups * 3 + 1) * sizeof(*ext_ranges));
+  if (gdt == NULL || ext_ranges == NULL || \
+      ext_read(fd, gdt, gdt_len, gdt_offset) != gdt_len) {
+    free(gdt);
+    p_close(fd);
+    return true;
+  }
+  p_close(fd);
+
+  for (g = 0; g < groups; g++) {
+    desc = gdt + g * desc_size;
+
+    if (! csum || ! (get16(desc + 18) & EXT_BG_BLOCK_UNINIT))
+      ext_add((get32(desc) | (desc_size >= 64 ? (off64_t) get32(desc + 32) << 32 : 0)) \
+        * block_size, block_size);
+
+    if (csum && get16(desc + 18) & EXT_BG_INODE_UNINIT)
+      continue;
+
+    ext_add((get32(desc + 4) | (desc_size >= 64 ? (off64_t) get32(desc + 36) << 32 : 0)) \
+      * block_size, block_size);
+
+    /* only the used part of an inode table */
+    used = inodes_per_group;
+    if (csum) {
+      used -= get16(desc + 28) | (desc_size >= 64 ? (uint32_t) get16(desc + 50) << 16 : 0);
+      if (used > inodes_per_group)
+        used = inodes_per_group;
+    }
+    ext_add((get32(desc + 8) | (desc_size >= 64 ? (off64_t) get32(desc + 40) << 32 : 0)) \
+      * block_size, (off64_t) used * inode_size);
+  }
+  free(gdt);
+
+  ext_merge();
+  dprint(LOG_INFO, true, "fawrap.so ext groups %llu, metadata ranges %zu", \
+    (unsigned long long) groups, ext_count);
+  return false;
+}
+
+void ext_item(size_t item, void *ctx) {
+  prefetch_range(ext_ranges[item].offset, ext_ranges[item].len);
+  __atomic_fetch_add(&prefetch_bytes, ext_ranges[item].len, __ATOMIC_RELAXED);
+}
+
+void *prefetch_thread(void *arg) {
+off64_t offset, len;
+
+  parallel_run(ext_count, ext_item, NULL);
+  trace_prefetch();
+
+  pthread_mutex_lock(&prefetch_lock);
+  for (;;) {
+    while (prefetch_head == prefetch_tail)
+      pthread_cond_wait(&prefetch_cond, &prefetch_lock);
+
+    offset = prefetch_off[prefetch_head % PREFETCH_QUEUE];
+    len = prefetch_len[prefetch_head % PREFETCH_QUEUE];
+    prefetch_head++;
+    pthread_mutex_unlock(&prefetch_lock);
+
+    prefetch_range(offset, len);
+
+    pthread_mutex_lock(&prefetch_lock);
+    __atomic_fetch_add(&prefetch_bytes, len, __ATOMIC_RELAXED);
+  }
+
+  return NULL;
+}
+
+bool prefetch_init(void) {
+pthread_t tid;
+
+  if (prefetch_started)
+    return false;
+
+  prefetch_fd = p_open64(target_name, O_RDONLY);
+  if (prefetch_fd < 0 || pthread_create(&tid, NULL, prefetch_thread, NULL) != 0)
+    return true;
+
+  pthread_detach(tid);
+  prefetch_started = true;
+  return false;
+}
+
+void prefetch_queue(off64_t offset, off64_t len) {
+  if (offset >= segment_len || len <= 0)
+    return;
+  if (len > segment_len - offset)
+    len = segment_len - offset;
+
+  pthread_mutex_lock(&prefetch_lock);
+  if (prefetch_tail - prefetch_head < PREFETCH_QUEUE) {
+    prefetch_off[prefetch_tail % PREFETCH_QUEUE] = offset;
+    prefetch_len[prefetch_tail % PREFETCH_QUEUE] = len;
+    prefetch_tail++;
+    pthread_cond_signal(&prefetch_cond);
+  } else
+    prefetch_dropped++;
+  pthread_mutex_unlock(&prefetch_lock);
+}
+
+static uint64_t trace_hash(uint64_t h, const void *data, size_t len) {
+const unsigned char *p = data;
+size_t i;
+
+  for (i = 0; i < len; i++) {
+    h ^= p[i];
+    h *= 1099511628211ULL;    /* FNV-1a */
+  }
+
+  return h;
+}
+
+/* note blocks of a target read not seen before */
+void trace_access(off64_t offset, size_t count) {
+size_t block, last = (offset + count - 1) / TRACE_BLOCK;
+uint32_t *order;
+
+  pthread_mutex_lock(&trace_lock);
+  for (block = offset / TRACE_BLOCK; block <= last; block++) {
+    if (bitmap_test(&trace_seen, block))
+      continue;
+    bitmap_set(&trace_seen, block, block);
+
+    if (trace_count == trace_size) {
+      order = realloc(trace_order, (trace_size + 1024) * sizeof(*order));
+      if (order == NULL)
+        break;
+      trace_order = order;
+      trace_size += 1024;
+    }
+    trace_order[trace_count++] = block;
+  }
+  pthread_mutex_unlock(&trace_lock);
+}
+
+/* records are key (8), data bytes (4), blocks (4) and block
+   numbers as zigzag varint deltas from the previous one */
+static size_t varint_put(unsigned char *p, uint64_t v) {
+size_t n = 0;
+
+  while (v >= 0x80) {
+    p[n++] = v | 0x80;
+    v >>= 7;
+  }
+  p[n++] = v;
+  return n;
+}
+
+static size_t varint_get(const unsigned char *p, size_t len, uint64_t *v) {
+size_t n = 0;
+int shift = 0;
+
+  *v = 0;
+  while (n < len && shift < 64) {
+    *v |= (uint64_t) (p[n] & 0x7f) << shift;
+    if (! (p[n++] & 0x80))
+      return n;
+    shift += 7;
+  }
+  return 0;
+}
+
+/* whole profile file, NULL if missing or not a profile */
+unsigned char *trace_read(size_t *len) {
+unsigned char *data;
+struct stat64 st;
+int fd;
+
+  fd = p_open64(profile_name, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  data = NULL;
+  if (real_fstat64(fd, &st) == 0 && st.st_size >= 8) {
+    *len = st.st_size;
+    data = malloc(st.st_size);
+    if (data != NULL && (p_pread64(fd, data, st.st_size, 0) != st.st_size || \
+        memcmp(data, TRACE_MAGIC, 8) != 0)) {
+      free(data);
+      data = NULL;
+    }
+  }
+  p_close(fd);
+
+  return data;
+}
+
+bool trace_init(const char *canon) {
+unsigned char *data;
+size_t len, pos, n, end;
+uint32_t size, count;
+uint64_t key, delta, block;
+
+  trace_key = trace_hash(14695981039346656037ULL, \
+    program_invocation_short_name, strlen(program_invocation_short_name) + 1);
+  trace_key = trace_hash(trace_key, canon, strlen(canon) + 1);
+  trace_key = trace_hash(trace_key, &segment_offset, sizeof(segment_offset));
+  trace_key = trace_hash(trace_key, &segment_len, sizeof(segment_len));
+
+  if (bitmap_alloc(&trace_seen, (segment_len + TRACE_BLOCK - 1) / TRACE_BLOCK))
+    return true;
+
+  data = trace_read(&len);
+  if (data == NULL)
+    return false;
+
+  for (pos = 8; pos + 16 <= len; pos = end) {
+    memcpy(&key, data + pos, 8);
+    memcpy(&size, data + pos + 8, 4);
+    memcpy(&count, data + pos + 12, 4);
+    pos += 16;
+    end = pos + size;
+    if (end > len)
+      break;
+    if (key != trace_key)
+      continue;
+
+    trace_replay = malloc(count * sizeof(*trace_replay));
+    if (trace_replay == NULL)
+      break;
+
+    /* stale entries out of segment are dropped */
+    for (block = 0; trace_replay_count < count; pos += n) {
+      n = varint_get(data + pos, end - pos, &delta);
+      if (n == 0)
+        break;
+      block += (delta >> 1) ^ -(delta & 1);
+      if (block < trace_seen.size)
+        trace_replay[trace_replay_count++] = block;
+    }
+    break;
+  }
+
+  free(data);
+  dprint(LOG_INFO, true, "fawrap.so profile %s: %zu blocks", profile_name, \
+    trace_replay_count);
+  return false;
+}
+
+/* other records of the file are kept, ours is replaced */
+void trace_save(void) {
+char tmp[PATH_MAX];
+unsigned char *old, *buf, *p;
+size_t len = 0, pos, i, size;
+uint64_t key, delta, prev = 0;
+uint32_t rec_size, count;
+int fd;
+
+  if (trace_count == 0)
+    return;
+
+  old = trace_read(&len);
+  if (old == NULL)
+    len = 0;
+
+  buf = malloc(len + 8 + 16 + trace_count * 10);
+  if (buf == NULL) {
+    free(old);
+    return;
+  }
+
+  memcpy(buf, TRACE_MAGIC, 8);
+  p = buf + 8;
+
+  for (pos = 8; old != NULL && pos + 16 <= len; pos += 16 + rec_size) {
+    memcpy(&key, old + pos, 8);
+    memcpy(&rec_size, old + pos + 8, 4);
+    if (pos + 16 + rec_size > len)
+      break;
+    if (key != trace_key) {
+      memcpy(p, old + pos, 16 + rec_size);
+      p += 16 + rec_size;
+    }
+  }
+  free(old);
+
+  for (i = 0, size = 0; i < trace_count; i++) {
+    delta = trace_order[i] - prev;
+    delta = (delta << 1) ^ -((int64_t) delta < 0);
+    size += varint_put(p + 16 + size, delta);
+    prev = trace_order[i];
+  }
+  rec_size = size;
+  count = trace_count;
+  memcpy(p, &trace_key, 8);
+  memcpy(p + 8, &rec_size, 4);
+  memcpy(p + 12, &count, 4);
+  p += 16 + size;
+
+  /* concurrent runs never see a half written profile */
+  snprintf(tmp, sizeof(tmp), "%s.%d", profile_name, (int) getpid());
+  fd = p_open64(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd >= 0) {
+    if (p_write(fd, buf, p - buf) == p - buf && p_close(fd) == 0)
+      rename(tmp, profile_name);
+    else {
+      p_close(fd);
+      unlink(tmp);
+    }
+  }
+
+  free(buf);
+}
+
+/* after a read of target fd: sequential reads double the window up
+   to ra_max and keep it filled ahead, random ones halve it */
+void readahead_access(struct target *t, off64_t offset, size_t count) {
+off64_t end = offset + count;
+off64_t start;
+
+  if (offset == t->ra_next) {
+    t->ra_window = t->ra_window ? t->ra_window * 2 : RA_MIN;
+    if (t->ra_window > ra_max)
+      t->ra_window = ra_max;
+
+    /* refill when less than half window is left ahead */
+    if (t->ra_end - end < t->ra_window / 2) {
+      start = t->ra_end > end ? t->ra_end : end;
+      if (end + t->ra_window > start) {
+        prefetch_queue(start, end + t->ra_window - start);
+        t->ra_end = end + t->ra_window;
+      }
+    }
+  } else {
+    t->ra_window /= 2;
+    t->ra_end = 0;
+  }
+
+  t->ra_next = end;
+}
+
+/* split: a large read or write of the target is cut into chunks
+   which pool threads issue in parallel, the call returns when all
+   of them are done; only direct engine is safe to call this way */
+static size_t split_chunk = 0;    /* 0 - disabled */
+static unsigned long long split_calls = 0;
+static unsigned long long split_chunks = 0;
+static unsigned long long split_busy = 0;    /* done whole, pool busy */
+
+struct split_job {
+  int fd;
+  char *buf;
+  size_t count;
+  off64_t offset;
+  bool write;
+  ssize_t *res;    /* bytes done per chunk */
+  int *err;        /* errno per chunk */
+};
+
+void split_item(size_t item, void *ctx) {
+struct split_job *job = ctx;
+size_t start = item * split_chunk;
+size_t len = job->count - start < split_chunk ? job->count - start : split_chunk;
+size_t done = 0;
+ssize_t res = 0;
+
+  while (done < len) {
+    if (job->write)
+      res = engine->pwrite(job->fd, job->buf + start + done, len - done, \
+        job->offset + start + done);
+    else
+      res = engine->pread(job->fd, job->buf + start + done, len - done, \
+        job->offset + start + done);
+    if (res <= 0)
+      break;
+    done += res;
+  }
+
+  job->res[item] = res < 0 && done == 0 ? -1 : (ssize_t) done;
+  job->err[item] = errno;
+}
+
+/* result as if done by one call: bytes up to first short chunk */
+ssize_t split_io(int fd, void *buf, size_t count, off64_t offset, bool write) {
+struct split_job job = { fd, buf, count, offset, write, NULL, NULL };
+size_t chunks = (count + split_chunk - 1) / split_chunk;
+size_t i, len;
+ssize_t total = 0;
+
+  job.res = malloc(chunks * sizeof(*job.res));
+  job.err = malloc(chunks * sizeof(*job.err));
+
+  /* pool busy (metadata prefetch, another split) is not waited
+     for, call is done whole instead */
+  if (job.res == NULL || job.err == NULL || parallel_try(chunks, split_item, &job)) {
+    if (job.res != NULL && job.err != NULL)
+      __atomic_fetch_add(&split_busy, 1, __ATOMIC_RELAXED);
+    free(job.res);
+    free(job.err);
+    return write ? engine->pwrite(fd, buf, count, offset) : \
+      engine->pread(fd, buf, count, offset);
+  }
+
+  for (i = 0; i < chunks; i++) {
+    if (job.res[i] < 0) {
+      if (total == 0) {
+        errno = job.err[i];
+        total = -1;
+      }
+      break;
+    }
+
+    total += job.res[i];
+    len = count - i * split_chunk < split_chunk ? count - i * split_chunk : split_chunk;
+    if ((size_t) job.res[i] < len)
+      break;
+  }
+
+  __atomic_fetch_add(&split_calls, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&split_chunks, chunks, __ATOMIC_RELAXED);
+
+  free(job.res);
+  free(job.err);
+  return total;
+}
+
+/* target read as configured: split or by engine */
+ssize_t target_pread(int fd, void *buf, size_t count, off64_t offset) {
+  if (split_chunk > 0 && count > split_chunk)
+    return split_io(fd, buf, count, offset, false);
+
+  return engine->pread(fd, buf, count, offset);
+}
+
+ssize_t target_pwrite(int fd, const void *buf, size_t count, off64_t offset) {
+  if (split_chunk > 0 && count > split_chunk)
+    return split_io(fd, (void *) buf, count, offset, true);
+
+  return engine->pwrite(fd, buf, count, offset);
+}
+
+/* shared cache: a daemon started on demand holds a memfd with 4K
+   blocks of the segment and passes it to every preloaded process
+   over an abstract unix socket named after the segment; slots are
+   guarded by seqlocks which never block, a slot whose owner died
+   while filling it just stays empty */
+#define SHC_MAGIC "FAWRAPSC"
+#define SHC_BLOCK 4096
+#define SHC_SPAN 64     /* larger reads bypass cache */
+
+struct shc_header {
+  char magic[8];
+  uint64_t dev, ino;
+  uint64_t offset, len;
+  int64_t mtime_sec, mtime_nsec;    /* image when cache was valid */
+  uint64_t slots;
+};
+
+struct shc_slot {
+  uint64_t seq;      /* odd while being filled */
+  uint64_t valid;    /* seq at which data became valid */
+  uint64_t block;
+};
+
+static bool shc_on = false;
+static off64_t shc_size = 64 << 20;
+static int shc_idle = 300;     /* seconds daemon waits for clients */
+static struct shc_header *shc_mem = NULL;
+static size_t shc_map_len = 0;
+static struct shc_slot *shc_slots = NULL;
+static char *shc_data = NULL;
+static bool shc_written = false;
+static unsigned long long shc_hits = 0;
+static unsigned long long shc_misses = 0;
+
+static inline struct shc_slot *shc_slot(uint64_t block) {
+  return &shc_slots[(block * 0x9E3779B97F4A7C15ULL >> 16) % shc_mem->slots];
+}
+
+/* copy block out, false if not cached */
+bool shc_get(uint64_t block, char *buf) {
+struct shc_slot *slot = shc_slot(block);
+uint64_t seq;
+
+  seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+  if (seq & 1 || __atomic_load_n(&slot->valid, __ATOMIC_RELAXED) != seq || \
+      __atomic_load_n(&slot->block, __ATOMIC_RELAXED) != block)
+    return false;
+
+  memcpy(buf, shc_data + (slot - shc_slots) * SHC_BLOCK, SHC_BLOCK);
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq;
+}
+
+/* fill slot, only if nobody touched it since seq was taken */
+void shc_put(uint64_t block, const char *buf, uint64_t seq) {
+struct shc_slot *slot = shc_slot(block);
+uint64_t locked = seq + 1;
+
+  if (seq & 1 || ! __atomic_compare_exchange_n(&slot->seq, &seq, locked, false, \
+      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return;
+
+  __atomic_store_n(&slot->block, block, __ATOMIC_RELAXED);
+  memcpy(shc_data + (slot - shc_slots) * SHC_BLOCK, buf, SHC_BLOCK);
+  __atomic_store_n(&slot->valid, locked + 1, __ATOMIC_RELEASE);
+
+  /* invalidated meanwhile: seq moved by 2, leave it even and stale */
+  if (! __atomic_compare_exchange_n(&slot->seq, &locked, locked + 1, false, \
+      __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    __atomic_fetch_add(&slot->seq, 1, __ATOMIC_RELEASE);
+}
+
+static inline uint64_t shc_seq(uint64_t block) {
+  return __atomic_load_n(&shc_slot(block)->seq, __ATOMIC_ACQUIRE);
+}
+
+/* after data on disk changed; returns seq for a following put */
+uint64_t shc_invalidate(uint64_t block) {
+  return __atomic_add_fetch(&shc_slot(block)->seq, 2, __ATOMIC_ACQ_REL);
+}
+
+ssize_t shc_pread(int fd, void *buf, size_t count, off64_t offset) {
+uint64_t first = offset / SHC_BLOCK;
+uint64_t last = (offset + count - 1) / SHC_BLOCK;
+uint64_t seq[SHC_SPAN];
+uint64_t block, start, end;
+char tmp[SHC_BLOCK];
+char *span;
+size_t skip, len;
+ssize_t res;
+
+  if (count == 0)
+    return 0;
+  if (last - first >= SHC_SPAN)
+    return target_pread(fd, buf, count, offset);
+
+  /* all blocks cached: no syscall at all */
+  for (block = first; block <= last; block++) {
+    if (! shc_get(block, tmp))
+      break;
+    skip = block == first ? offset % SHC_BLOCK : 0;
+    len = SHC_BLOCK - skip;
+    if (block == last)
+      len = (offset + count - 1) % SHC_BLOCK + 1 - skip;
+    memcpy((char *) buf + (block * SHC_BLOCK + skip - offset), tmp + skip, len);
+  }
+  if (block > last) {
+    __atomic_fetch_add(&shc_hits, 1, __ATOMIC_RELAXED);
+    return count;
+  }
+  __atomic_fetch_add(&shc_misses, 1, __ATOMIC_RELAXED);
+
+  /* seqs are taken before the read, a write racing with it wins */
+  for (block = first; block <= last; block++)
+    seq[block - first] = shc_seq(block);
+
+  /* small reads are widened to whole blocks so they can be cached */
+  start = first * SHC_BLOCK;
+  end = (last + 1) * SHC_BLOCK < (uint64_t) segment_len ? (last + 1) * SHC_BLOCK : segment_len;
+  span = (start == (uint64_t) offset && end - start == count) ? buf : malloc(end - start);
+  if (span == NULL)
+    return target_pread(fd, buf, count, offset);
+
+  res = target_pread(fd, span, end - start, start);
+
+  for (block = first; res > 0 && block <= last; block++) {
+    if ((block + 1) * SHC_BLOCK <= start + res)
+      shc_put(block, span + (block - first) * SHC_BLOCK, seq[block - first]);
+  }
+
+  if (span != buf) {
+    if (res >= 0) {
+      res = res > (ssize_t) (offset - start) ? res - (ssize_t) (offset - start) : 0;
+      if (res > (ssize_t) count)
+        res = count;
+      memcpy(buf, span + (offset - start), res);
+    }
+    free(span);
+  }
+
+  return res;
+}
+
+/* whole blocks of a write are cached, partial ones dropped */
+void shc_write(const void *buf, off64_t offset, off64_t len, bool update) {
+uint64_t block, seq;
+
+  if (len <= 0)
+    return;
+
+  shc_written = true;
+  for (block = offset / SHC_BLOCK; block <= (uint64_t) (offset + len - 1) / SHC_BLOCK; block++) {
+    seq = shc_invalidate(block);
+    if (update && (off64_t) (block * SHC_BLOCK) >= offset && \
+        (off64_t) ((block + 1) * SHC_BLOCK) <= offset + len)
+      shc_put(block, (const char *) buf + (block * SHC_BLOCK - offset), seq);
+  }
+}
+
+void shc_address(struct sockaddr_un *addr, socklen_t *len, struct stat64 *st) {
+uint64_t key = trace_hash(14695981039346656037ULL, &st->st_dev, sizeof(st->st_dev));
+
+  key = trace_hash(key, &st->st_ino, sizeof(st->st_ino));
+  key = trace_hash(key, &segment_offset, sizeof(segment_offset));
+  key = trace_hash(key, &segment_len, sizeof(segment_len));
+
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  /* abstract namespace, nothing left behind in filesystem */
+  *len = offsetof(struct sockaddr_un, sun_path) + 1 + \
+    snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "fawrap-%u-%016llx", \
+      (unsigned) getuid(), (unsigned long long) key);
+}
+
+/* runs detached, hands memfd to every client of same user */
+void shc_daemon(struct sockaddr_un *addr, socklen_t addr_len, struct stat64 *st) {
+struct shc_header *hdr;
+struct pollfd pfd;
+struct ucred cred;
+socklen_t cred_len;
+struct msghdr msg;
+struct cmsghdr *cmsg;
+struct iovec iov;
+char cbuf[CMSG_SPACE(sizeof(int))];
+char byte = 0;
+size_t slots = shc_size / SHC_BLOCK;
+size_t len = sizeof(*hdr) + slots * (sizeof(struct shc_slot) + SHC_BLOCK);
+size_t meta = sizeof(*hdr) + slots * sizeof(struct shc_slot);
+struct shc_slot *slot;
+int sock, conn, memfd;
+size_t i;
+
+  sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock < 0 || bind(sock, (struct sockaddr *) addr, addr_len) != 0 || listen(sock, 16) != 0)
+    _exit(0);   /* lost the race to another daemon */
+
+  memfd = memfd_create("fawrap-cache", MFD_CLOEXEC);
+  if (memfd < 0 || ftruncate(memfd, len) != 0)
+    _exit(1);
+
+  hdr = mmap(NULL, meta, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+  if (hdr == MAP_FAILED)
+    _exit(1);
+
+  /* zeroed slot would pass as valid copy of block 0 */
+  slot = (struct shc_slot *) (hdr + 1);
+  for (i = 0; i < slots; i++)
+    slot[i].block = UINT64_MAX;
+  memcpy(hdr->magic, SHC_MAGIC, 8);
+  hdr->dev = st->st_dev;
+  hdr->ino = st->st_ino;
+  hdr->offset = segment_offset;
+  hdr->len = segment_len;
+  hdr->mtime_sec = st->st_mtim.tv_sec;
+  hdr->mtime_nsec = st->st_mtim.tv_nsec;
+  hdr->slots = slots;
+  munmap(hdr, meta);
+
+  pfd.fd = sock;
+  pfd.events = POLLIN;
+  while (poll(&pfd, 1, shc_idle * 1000) > 0) {
+    conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+    if (conn < 0)
+      continue;
+
+    cred_len = sizeof(cred);
+    if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == 0 && \
+        cred.uid == getuid()) {
+      memset(&msg, 0, sizeof(msg));
+      iov.iov_base = &byte;
+      iov.iov_len = 1;
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = cbuf;
+      msg.msg_controllen = sizeof(cbuf);
+      cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+      memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+      sendmsg(conn, &msg, MSG_NOSIGNAL);
+    }
+    close(conn);
+  }
+
+  _exit(0);
+}
+
+int shc_connect(struct sockaddr_un *addr, socklen_t addr_len) {
+struct msghdr msg;
+struct cmsghdr *cmsg;
+struct iovec iov;
+char cbuf[CMSG_SPACE(sizeof(int))];
+char byte;
+int sock, memfd = -1;
+
+  sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock < 0)
+    return -1;
+
+  if (connect(sock, (struct sockaddr *) addr, addr_len) == 0) {
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) == 1 && \
+        (cmsg = CMSG_FIRSTHDR(&msg)) != NULL && cmsg->cmsg_type == SCM_RIGHTS)
+      memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+  }
+
+  p_close(sock);
+  return memfd;
+}
+
+/* double fork, daemon must not keep pipes of our caller open */
+void shc_spawn(struct sockaddr_un *addr, socklen_t addr_len, struct stat64 *st) {
+pid_t pid;
+int fd;
+
+  pid = fork();
+  if (pid < 0)
+    return;
+
+  if (pid == 0) {
+    setsid();
+    if (fork() != 0)
+      _exit(0);
+
+    syscall(SYS_close_range, 0, ~0U, 0);
+    fd = p_open("/dev/null", O_RDWR);
+    if (fd == 0) {
+      dup2(fd, 1);
+      dup2(fd, 2);
+    }
+    shc_daemon(addr, addr_len, st);
+  }
+
+  waitpid(pid, NULL, 0);
+}
+
+bool shc_init(void) {
+struct sockaddr_un addr;
+socklen_t addr_len;
+struct stat64 st, mst;
+uint64_t i;
+int memfd, tries;
+
+  if (real_stat64(target_name, &st) != 0)
+    return true;
+
+  shc_address(&addr, &addr_len, &st);
+  memfd = shc_connect(&addr, addr_len);
+  for (tries = 0; memfd < 0 && tries < 100; tries++) {
+    if (tries == 0)
+      shc_spawn(&addr, addr_len, &st);
+    usleep(10000);
+    memfd = shc_connect(&addr, addr_len);
+  }
+  if (memfd < 0) {
+    dprint(LOG_ERR, true, "fawrap.so shared cache daemon not reachable");
+    return true;
+  }
+
+  if (real_fstat64(memfd, &mst) != 0 || mst.st_size < (off64_t) sizeof(*shc_mem)) {
+    p_close(memfd);
+    return true;
+  }
+
+  shc_map_len = mst.st_size;
+  shc_mem = mmap(NULL, shc_map_len, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+  p_close(memfd);
+  if (shc_mem == MAP_FAILED) {
+    shc_mem = NULL;
+    return true;
+  }
+
+  if (memcmp(shc_mem->magic, SHC_MAGIC, 8) != 0 || shc_mem->dev != st.st_dev || \
+      shc_mem->ino != st.st_ino || shc_mem->offset != segment_offset || \
+      shc_mem->len != segment_len || shc_mem->slots == 0 || \
+      sizeof(*shc_mem) + shc_mem->slots * (sizeof(struct shc_slot) + SHC_BLOCK) > shc_map_len) {
+    dprint(LOG_ERR, true, "fawrap.so shared cache belongs to another segment");
+    munmap(shc_mem, shc_map_len);
+    shc_mem = NULL;
+    return true;
+  }
+
+  shc_slots = (struct shc_slot *) (shc_mem + 1);
+  shc_data = (char *) (shc_slots + shc_mem->slots);
+
+  /* image changed by something not preloaded: forget everything */
+  if (shc_mem->mtime_sec != st.st_mtim.tv_sec || shc_mem->mtime_nsec != st.st_mtim.tv_nsec) {
+    for (i = 0; i < shc_mem->slots; i++)
+      __atomic_fetch_add(&shc_slots[i].seq, 2, __ATOMIC_RELEASE);
+    shc_mem->mtime_sec = st.st_mtim.tv_sec;
+    shc_mem->mtime_nsec = st.st_mtim.tv_nsec;
+    dprint(LOG_INFO, true, "fawrap.so shared cache: image changed, cleared");
+  }
+
+  dprint(LOG_INFO, true, "fawrap.so shared cache: %llu blocks", \
+    (unsigned long long) shc_mem->slots);
+  return false;
+}
+
+/* our writes are in cache, so new mtime of image is not a change */
+void shc_fini(void) {
+struct stat64 st;
+
+  if (shc_written && real_stat64(target_name, &st) == 0) {
+    shc_mem->mtime_sec = st.st_mtim.tv_sec;
+    shc_mem->mtime_nsec = st.st_mtim.tv_nsec;
+  }
+
+  report("shared cache hits %llu, misses %llu", shc_hits, shc_misses);
+  munmap(shc_mem, shc_map_len);
+  shc_mem = NULL;
+}
+
+/* zero mode: segment starts as all zeros, blocks never written (holes
+   of image at start, nothing written since) are read from memory;
+   image is created and extended sparse, no need to zero it first */
+#define ZERO_BLOCK 4096
+
+static bool zero_mode = false;
+static struct bitmap zero_written;
+static unsigned long long zero_bytes = 0;
+
+bool zero_init(void) {
+off64_t data, hole, end = segment_offset + segment_len;
+struct stat64 st;
+int fd;
+
+  /* base image of overlay is never written, map has no single
+     image, holes of a qcow2 or zstd image are not holes of the disk */
+  if (engine == &overlay_engine || engine == &map_engine || \
+      engine == &qcow_engine || engine == &zst_engine) {
+    dprint(LOG_ERR, true, "fawrap.so zero can't be combined with %s", engine->name);
+    return true;
+  }
+
+  /* old contents of a device are not known to be zeros */
+  if (target_blkdev) {
+    dprint(LOG_ERR, true, "fawrap.so zero can't be used on a block device");
+    return true;
+  }
+
+  fd = p_open64(target_name, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    dprint(LOG_ERR, true, "fawrap.so can't open %s", target_name);
+    return true;
+  }
+
+  if (real_fstat64(fd, &st) != 0 || \
+      (st.st_size < end && p_ftruncate64(fd, end) != 0) || \
+      bitmap_alloc(&zero_written, (segment_len + ZERO_BLOCK - 1) / ZERO_BLOCK)) {
+    p_close(fd);
+    return true;
+  }
+
+  /* data already in segment counts as written, rounded outwards */
+  for (data = segment_offset; ; data = hole) {
+    data = p_lseek64(fd, data, SEEK_DATA);
+    if (data < 0 || data >= end)
+      break;
+    hole = p_lseek64(fd, data, SEEK_HOLE);
+    if (hole < 0 || hole > end)
+      hole = end;
+    bitmap_set(&zero_written, (data - segment_offset) / ZERO_BLOCK, \
+      (hole - segment_offset - 1) / ZERO_BLOCK);
+  }
+
+  p_close(fd);
+  return false;
+}
+
+/* runs of unwritten blocks are zeroed, the rest is read */
+ssize_t zero_pread(int fd, void *buf, size_t count, off64_t offset) {
+size_t block, len, done = 0;
+bool written;
+ssize_t res;
+
+  while (done < count) {
+    block = (offset + done) / ZERO_BLOCK;
+    written = bitmap_test(&zero_written, block);
+    len = (block + 1) * ZERO_BLOCK - (offset + done);
+    while (done + len < count && bitmap_test(&zero_written, ++block) == written)
+      len += ZERO_BLOCK;
+    if (len > count - done)
+      len = count - done;
+
+    if (! written) {
+      memset((char *) buf + done, 0, len);
+      __atomic_fetch_add(&zero_bytes, len, __ATOMIC_RELAXED);
+      done += len;
+      continue;
+    }
+
+    res = shc_mem != NULL ? shc_pread(fd, (char *) buf + done, len, offset + done) : \
+      target_pread(fd, (char *) buf + done, len, offset + done);
+    if (res < 0)
+      return done > 0 ? (ssize_t) done : -1;
+    done += res;
+    if ((size_t) res < len)
+      break;
+  }
+
+  return done;
+}
+
+/* a block written partly is still right: rest of it is a hole */
+void zero_write(off64_t offset, off64_t len) {
+  if (len > 0)
+    bitmap_set(&zero_written, offset / ZERO_BLOCK, (offset + len - 1) / ZERO_BLOCK);
+}
+
+/* whole blocks punched or zeroed read as zeros again */
+void zero_discard(off64_t offset, off64_t len) {
+size_t first = (offset + ZERO_BLOCK - 1) / ZERO_BLOCK;
+size_t last = (offset + len) / ZERO_BLOCK;
+
+  if (offset + len == segment_len)
+    last = zero_written.size;
+  if (last > first)
+    bitmap_clear(&zero_written, first, last - 1);
+}
+
+/* export: when last target fd is closed a thread writes a seekable
+   zstd copy of segment while program winds down, batches of frames
+   are compressed on the pool; ranges known to be zeros (holes of
+   image, blocks never written in zero mode, unallocated qcow2
+   clusters) are not read and zero frames are compressed only once.
+   A later write makes the copy stale, it is made again at exit and
+   then renamed in place of export file */
+#define EXPORT_FRAME (1 << 20)
+
+struct export_frame {
+  char *out;
+  size_t len;          /* compressed */
+  bool zero;
+  int err;
+};
+
+struct export_job {
+  int fd;              /* own fd of target */
+  off64_t first;       /* segment offset of first frame */
+  struct export_frame *frames;
+};
+
+static char *export_name = NULL;
+static int export_level = 3;
+static unsigned long export_gen = 0;   /* writes to segment */
+static unsigned long export_done = ULONG_MAX;   /* gen of finished copy */
+static bool export_started = false;
+static bool export_running = false;
+static pthread_t export_tid;
+static pid_t export_pid;    /* thread is not inherited by fork */
+static __thread void *export_cctx = NULL;
+static unsigned long long export_frames = 0;
+static unsigned long long export_zero = 0;
+static unsigned long long export_unread = 0;
+static unsigned long long export_bytes = 0;
+
+/* range of segment reads as zeros without reading it */
+bool export_known_zero(int fd, off64_t offset, off64_t len) {
+uint64_t part = len;
+off64_t data;
+size_t b;
+
+  if (zero_mode) {
+    for (b = offset / ZERO_BLOCK; b <= (size_t) ((offset + len - 1) / ZERO_BLOCK); b++) {
+      if (bitmap_test(&zero_written, b))
+        return false;
+    }
+    return true;
+  }
+
+  if (engine == &qcow_engine)
+    return qcow_find(segment_offset + offset, &part) == 0 && part == (uint64_t) len;
+
+  if (engine == &direct_engine) {
+    data = p_lseek64(fd, segment_offset + offset, SEEK_DATA);
+    return (data < 0 && errno == ENXIO) || data >= segment_offset + offset + len;
+  }
+
+  return false;
+}
+
+void export_item(size_t item, void *ctx) {
+struct export_job *job = ctx;
+struct export_frame *f = &job->frames[item];
+off64_t offset = job->first + (off64_t) item * EXPORT_FRAME;
+size_t len = segment_len - offset < EXPORT_FRAME ? segment_len - offset : EXPORT_FRAME;
+char *buf;
+size_t res;
+
+  f->zero = false;
+  f->err = 0;
+  if (len == EXPORT_FRAME && export_known_zero(job->fd, offset, len)) {
+    f->zero = true;
+    __atomic_fetch_add(&export_unread, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  buf = malloc(len);
+  if (buf == NULL || (export_cctx == NULL && (export_cctx = zst_create_c()) == NULL)) {
+    free(buf);
+    f->err = ENOMEM;
+    return;
+  }
+
+  if (engine->pread(job->fd, buf, len, offset) != (ssize_t) len) {
+    f->err = errno != 0 ? errno : EIO;
+  } else if (len == EXPORT_FRAME && is_zero(buf, len)) {
+    f->zero = true;
+  } else {
+    res = zst_compress(export_cctx, f->out, zst_bound(EXPORT_FRAME), buf, len, export_level);
+    if (zst_is_error(res))
+      f->err = EIO;
+    else
+      f->len = res;
+  }
+
+  free(buf);
+}
+
+/* copy into export_name.tmp, true on error or when segment was
+   written meanwhile */
+bool export_run(void) {
+unsigned long gen = __atomic_load_n(&export_gen, __ATOMIC_ACQUIRE);
+size_t frames = (segment_len + EXPORT_FRAME - 1) / EXPORT_FRAME;
+size_t batch = pool_threads() * 2, bound = zst_bound(EXPORT_FRAME);
+struct export_frame *f = NULL;
+struct export_job job;
+unsigned char *table = NULL, head[8], footer[9];
+char tmp[PATH_MAX], *zero_in = NULL, *zero_out = NULL;
+size_t zero_len = 0, i, n, k;
+off64_t pos = 0;
+int out = -1;
+bool err = true;
+
+  snprintf(tmp, sizeof(tmp), "%s.%d.tmp", export_name, (int) getpid());
+  job.fd = p_open64(target_name, O_RDONLY);
+  out = p_open64(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  job.frames = f = calloc(batch, sizeof(*f));
+  table = malloc(frames * 8 + 1);
+  zero_in = calloc(1, EXPORT_FRAME);
+  zero_out = malloc(bound);
+  if (job.fd < 0 || out < 0 || f == NULL || table == NULL || zero_in == NULL || \
+      zero_out == NULL || (export_cctx == NULL && (export_cctx = zst_create_c()) == NULL))
+    goto out;
+
+  zero_len = zst_compress(export_cctx, zero_out, bound, zero_in, EXPORT_FRAME, export_level);
+  if (zst_is_error(zero_len))
+    goto out;
+  for (k = 0; k < batch; k++) {
+    if ((f[k].out = malloc(bound)) == NULL)
+      goto out;
+  }
+
+  for (i = 0; i < frames; i += n) {
+    if (__atomic_load_n(&export_gen, __ATOMIC_ACQUIRE) != gen)
+      goto out;
+
+    n = frames - i < batch ? frames - i : batch;
+    job.first = (off64_t) i * EXPORT_FRAME;
+    parallel_run(n, export_item, &job);
+
+    for (k = 0; k < n; k++) {
+      if (f[k].err != 0) {
+        errno = f[k].err;
+        dprint(LOG_ERR, true, "fawrap.so export of frame %zu failed", i + k);
+        goto out;
+      }
+      if (f[k].zero)
+        export_zero++;
+      if (write_all(out, f[k].zero ? zero_out : f[k].out, \
+          f[k].zero ? zero_len : f[k].len, &pos))
+        goto out;
+
+      put32(table + (i + k) * 8, f[k].zero ? zero_len : f[k].len);
+      put32(table + (i + k) * 8 + 4, (i + k + 1) * (uint64_t) EXPORT_FRAME > (uint64_t) segment_len ? \
+        segment_len - (i + k) * (uint64_t) EXPORT_FRAME : EXPORT_FRAME);
+    }
+  }
+
+  /* seek table as a skippable frame, footer without checksums */
+  put32(head, ZST_SKIP_MAGIC);
+  put32(head + 4, frames * 8 + sizeof(footer));
+  put32(footer, frames);
+  footer[4] = 0;
+  put32(footer + 5, ZST_SEEK_MAGIC);
+  if (write_all(out, head, sizeof(head), &pos) || \
+      write_all(out, table, frames * 8, &pos) || \
+      write_all(out, footer, sizeof(footer), &pos) || p_fdatasync(out) != 0)
+    goto out;
+
+  export_frames = frames;
+  export_bytes = pos;
+  err = __atomic_load_n(&export_gen, __ATOMIC_ACQUIRE) != gen;
+  if (! err)
+    export_done = gen;
+
+out:
+  if (f != NULL) {
+    for (k = 0; k < batch; k++)
+      free(f[k].out);
+  }
+  free(f);
+  free(table);
+  free(zero_in);
+  free(zero_out);
+  if (out >= 0)
+    p_close(out);
+  if (job.fd >= 0)
+    p_close(job.fd);
+  return err;
+}
+
+void *export_thread(void *arg) {
+  export_run();
+  return NULL;
+}
+
+/* after last target fd was closed */
+void export_start(void) {
+  if (export_running) {
+    pthread_join(export_tid, NULL);
+    export_running = false;
+  }
+
+  export_started = true;
+  export_pid = getpid();
+  if (export_done == __atomic_load_n(&export_gen, __ATOMIC_ACQUIRE))
+    return;
+
+  export_zero = 0;
+  export_unread = 0;
+  export_running = pthread_create(&export_tid, NULL, export_thread, NULL) == 0;
+}
+
+void export_fini(void) {
+char tmp[PATH_MAX];
+
+  /* copy of forked parent is its own to finish */
+  if (export_started && export_pid != getpid())
+    return;
+
+  if (export_running) {
+    pthread_join(export_tid, NULL);
+    export_running = false;
+  }
+
+  /* copy is written to a tmp file of this process */
+  snprintf(tmp, sizeof(tmp), "%s.%d.tmp", export_name, (int) getpid());
+  if (export_done != export_gen) {
+    export_zero = 0;
+    export_unread = 0;
+    if (export_run()) {
+      dprint(LOG_ERR, true, "fawrap.so export to %s failed", export_name);
+      unlink(tmp);
+      return;
+    }
+  }
+
+  if (rename(tmp, export_name) != 0) {
+    dprint(LOG_ERR, true, "fawrap.so can't rename %s", tmp);
+    return;
+  }
+
+  report("exported %llu frames, %llu zero, %llu not read, %llu bytes", \
+    export_frames, export_zero, export_unread, export_bytes);
+}
+
+/* dirty: blocks of segment written in this run are marked in a
+   bitmap; at exit it is merged into delta file left by earlier runs
+   and with data also current contents of all marked blocks are
+   stored, so fawrap-apply can bring another copy of base image up
+   to date by writing only changed blocks */
+#define DIRTY_RUN (1 << 20)   /* blocks read and written at once */
+
+static char *dirty_name = NULL;
+static bool dirty_data = false;
+static struct bitmap dirty_map;
+static bool dirty_marked = false;
+
+void dirty_mark(off64_t offset, off64_t len) {
+  if (len > 0) {
+    bitmap_set(&dirty_map, offset / DELTA_BLOCK, (offset + len - 1) / DELTA_BLOCK);
+    __atomic_store_n(&dirty_marked, true, __ATOMIC_RELAXED);
+  }
+}
+
+/* bitmap of delta file of earlier runs is added to ours */
+bool dirty_merge(void) {
+size_t words = delta_words(dirty_map.size);
+struct delta_hdr hdr;
+uint64_t *bits;
+bool err = true;
+size_t i;
+int fd;
+
+  fd = p_open64(dirty_name, O_RDONLY);
+  if (fd < 0)
+    return errno != ENOENT;
+
+  bits = malloc(words * sizeof(*bits));
+  if (bits == NULL || p_pread64(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || \
+      memcmp(hdr.magic, DELTA_MAGIC, sizeof(hdr.magic)) != 0 || hdr.version != DELTA_VERSION) {
+    dprint(LOG_ERR, true, "fawrap.so %s is not a delta file", dirty_name);
+  } else if (hdr.block_size != DELTA_BLOCK || hdr.segment_len != (uint64_t) segment_len) {
+    dprint(LOG_ERR, true, "fawrap.so delta %s is of another segment", dirty_name);
+  } else if (p_pread64(fd, bits, words * sizeof(*bits), sizeof(hdr)) == \
+      (ssize_t) (words * sizeof(*bits))) {
+    for (i = 0; i < words; i++)
+      dirty_map.bits[i] |= bits[i];
+    err = false;
+  }
+
+  free(bits);
+  p_close(fd);
+  return err;
+}
+
+/* delta file is replaced by merged one */
+bool dirty_write(void) {
+size_t words = delta_words(dirty_map.size);
+struct delta_hdr hdr;
+char tmp[PATH_MAX];
+char *buf = NULL;
+size_t block, start, i;
+off64_t pos = 0, len;
+int out, fd = -1;
+bool err = true;
+
+  if (dirty_merge())
+    return true;
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, DELTA_MAGIC, sizeof(hdr.magic));
+  hdr.version = DELTA_VERSION;
+  hdr.block_size = DELTA_BLOCK;
+  hdr.segment_len = segment_len;
+  hdr.blocks = dirty_map.size;
+  hdr.flags = dirty_data ? DELTA_DATA : 0;
+  for (i = 0; i < words; i++)
+    hdr.changed += __builtin_popcountll(dirty_map.bits[i]);
+
+  snprintf(tmp, sizeof(tmp), "%s.%d.tmp", dirty_name, (int) getpid());
+  out = p_open64(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out < 0 || write_all(out, &hdr, sizeof(hdr), &pos) || \
+      write_all(out, dirty_map.bits, words * sizeof(*dirty_map.bits), &pos))
+    goto out;
+
+  /* contents as they are now, in runs of marked blocks */
+  if (dirty_data) {
+    fd = p_open64(target_name, O_RDONLY);
+    buf = malloc(DIRTY_RUN);
+    if (fd < 0 || buf == NULL)
+      goto out;
+
+    for (block = 0; block < dirty_map.size; ) {
+      if (! bitmap_test(&dirty_map, block)) {
+        block++;
+        continue;
+      }
+
+      start = block;
+      while (block < dirty_map.size && bitmap_test(&dirty_map, block) && \
+          (block - start) * DELTA_BLOCK < DIRTY_RUN)
+        block++;
+
+      len = (off64_t) block * DELTA_BLOCK < segment_len ? (off64_t) block * DELTA_BLOCK : segment_len;
+      len -= (off64_t) start * DELTA_BLOCK;
+      if (engine->pread(fd, buf, len, (off64_t) start * DELTA_BLOCK) != len || \
+          write_all(out, buf, len, &pos))
+        goto out;
+    }
+  }
+
+  err = p_fdatasync(out) != 0;
+
+out:
+  free(buf);
+  if (fd >= 0)
+    p_close(fd);
+  if (out >= 0)
+    p_close(out);
+
+  if (err || rename(tmp, dirty_name) != 0) {
+    dprint(LOG_ERR, true, "fawrap.so can't write delta %s", dirty_name);
+    unlink(tmp);
+    return true;
+  }
+
+  report("dirty blocks %llu of %llu%s", (unsigned long long) hdr.changed, \
+    (unsigned long long) hdr.blocks, dirty_data ? ", stored with data" : "");
+  return false;
+}
+
+/* processes of a session finishing at once would each merge into
+   the old delta and the last rename would drop blocks of others */
+bool dirty_save(void) {
+char lock[PATH_MAX];
+bool err;
+int fd;
+
+  snprintf(lock, sizeof(lock), "%s.lock", dirty_name);
+  fd = p_open64(lock, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0 || flock(fd, LOCK_EX) != 0) {
+    dprint(LOG_ERR, true, "fawrap.so can't lock delta %s", dirty_name);
+    if (fd >= 0)
+      p_close(fd);
+    return true;
+  }
+
+  err = dirty_write();
+  p_close(fd);
+  return err;
+}
+
+/* dedup: a 64 bit hash of every block of segment is kept in a table
+   file; whole blocks of a write whose hash is the stored one are
+   already there and not written again, only runs of changed blocks
+   reach the engine. Table is valid while image keeps mtime saved
+   with it. Only first writing process (holding name.lock) uses the
+   table, writes of others mark it stale in lock file and then it is
+   dropped at exit instead of saved */
+#define DEDUP_MAGIC "FAWRAPDH"
+#define DEDUP_BLOCK 4096
+
+struct dedup_hdr {
+  char magic[8];
+  uint32_t version;
+  uint32_t block_size;
+  uint64_t segment_offset;
+  uint64_t segment_len;
+  int64_t mtime_sec;       /* of image when table was saved */
+  int64_t mtime_nsec;
+  uint64_t size;
+};
+
+static char *dedup_name = NULL;
+static int dedup_lock = -1;
+static uint64_t *dedup_hashes = NULL;   /* only in process holding lock */
+static size_t dedup_blocks = 0;
+static bool dedup_claimed = false;
+static pthread_mutex_t dedup_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool dedup_stale = false;
+static unsigned long long dedup_saved = 0;
+static unsigned long long dedup_written = 0;
+
+/* 0 is left for unknown contents */
+static uint64_t dedup_hash(const void *buf, size_t len) {
+uint64_t h[4] = { 1, 2, 3, 4 }, w, x;
+size_t i;
+int j;
+
+  for (i = 0; i + 32 <= len; i += 32) {
+    for (j = 0; j < 4; j++) {
+      memcpy(&w, (const char *) buf + i + j * 8, 8);
+      h[j] = (h[j] ^ w) * 0x9e3779b97f4a7c15ULL;
+      h[j] ^= h[j] >> 29;
+    }
+  }
+  for (x = len; i < len; i++)
+    x = (x ^ ((const unsigned char *) buf)[i]) * 1099511628211ULL;
+
+  x ^= h[0] ^ (h[1] << 17 | h[1] >> 47) ^ (h[2] << 31 | h[2] >> 33) ^ (h[3] << 47 | h[3] >> 17);
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x != 0 ? x : 1;
+}
+
+bool dedup_init(void) {
+char lock[PATH_MAX];
+
+  /* written table must be of image, its mtime tells if it still is */
+  if (engine == &overlay_engine || engine == &map_engine || target_blkdev) {
+    dprint(LOG_ERR, true, "fawrap.so dedup needs a writable image file");
+    return true;
+  }
+
+  snprintf(lock, sizeof(lock), "%s.lock", dedup_name);
+  dedup_lock = p_open64(lock, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  return dedup_lock < 0;
+}
+
+/* claimed at first write, so shells and make above the program
+   don't hold the table, true if this process has it */
+bool dedup_claim(void) {
+struct dedup_hdr hdr;
+struct stat64 st;
+int fd;
+
+  if (__atomic_load_n(&dedup_claimed, __ATOMIC_ACQUIRE))
+    return dedup_hashes != NULL;
+
+  pthread_mutex_lock(&dedup_mutex);
+  if (dedup_claimed) {
+    pthread_mutex_unlock(&dedup_mutex);
+    return dedup_hashes != NULL;
+  }
+
+  /* table is in use by another process, writes are only noted */
+  if (flock(dedup_lock, LOCK_EX | LOCK_NB) == 0) {
+    p_ftruncate64(dedup_lock, 0);
+    dedup_blocks = (segment_len + DEDUP_BLOCK - 1) / DEDUP_BLOCK;
+    dedup_hashes = calloc(dedup_blocks + 1, sizeof(*dedup_hashes));
+    if (dedup_hashes == NULL)
+      dprint(LOG_ERR, true, "fawrap.so dedup table %s failed", dedup_name);
+  }
+
+  fd = dedup_hashes != NULL ? p_open64(dedup_name, O_RDONLY) : -1;
+  if (fd >= 0) {
+    if (real_stat64(target_name, &st) != 0 || \
+        p_pread64(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || \
+        memcmp(hdr.magic, DEDUP_MAGIC, sizeof(hdr.magic)) != 0 || hdr.version != 1 || \
+        hdr.block_size != DEDUP_BLOCK || hdr.segment_offset != (uint64_t) segment_offset || \
+        hdr.segment_len != (uint64_t) segment_len || hdr.mtime_sec != st.st_mtim.tv_sec || \
+        hdr.mtime_nsec != st.st_mtim.tv_nsec || hdr.size != (uint64_t) st.st_size || \
+        p_pread64(fd, dedup_hashes, dedup_blocks * sizeof(*dedup_hashes), sizeof(hdr)) != \
+          (ssize_t) (dedup_blocks * sizeof(*dedup_hashes))) {
+      dprint(LOG_INFO, true, "fawrap.so dedup table %s is not of this image, starting empty", \
+        dedup_name);
+      memset(dedup_hashes, 0, dedup_blocks * sizeof(*dedup_hashes));
+    }
+    p_close(fd);
+  }
+
+  __atomic_store_n(&dedup_claimed, true, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&dedup_mutex);
+  return dedup_hashes != NULL;
+}
+
+/* write of a process without table makes the table stale */
+void dedup_foreign(void) {
+  if (! dedup_stale) {
+    dedup_stale = true;
+    p_pwrite64(dedup_lock, "s", 1, 0);
+  }
+}
+
+/* contents of range changed other than by dedup_pwrite */
+void dedup_forget(off64_t offset, off64_t len) {
+size_t b;
+
+  if (! dedup_claim()) {
+    dedup_foreign();
+    return;
+  }
+
+  for (b = offset / DEDUP_BLOCK; b <= (size_t) ((offset + len - 1) / DEDUP_BLOCK); b++)
+    dedup_hashes[b] = 0;
+}
+
+/* run of blocks that changed, their hashes are forgotten on error */
+ssize_t dedup_run(int fd, const char *buf, size_t len, off64_t offset) {
+ssize_t res = target_pwrite(fd, buf, len, offset);
+
+  if (res != (ssize_t) len)
+    dedup_forget(offset, len);
+  if (res > 0) {
+    __atomic_fetch_add(&dedup_written, res, __ATOMIC_RELAXED);
+    if (dirty_name != NULL)
+      dirty_mark(offset, res);
+  }
+
+  return res;
+}
+
+ssize_t dedup_pwrite(int fd, const void *buf, size_t count, off64_t offset) {
+const char *p = buf;
+size_t done, len, run = 0, b;
+off64_t pos, end;
+bool pending = false;
+uint64_t h;
+ssize_t res;
+
+  for (done = 0; done < count; done += len) {
+    pos = offset + done;
+    b = pos / DEDUP_BLOCK;
+    end = (off64_t) (b + 1) * DEDUP_BLOCK < segment_len ? (off64_t) (b + 1) * DEDUP_BLOCK : segment_len;
+    len = end - pos < (off64_t) (count - done) ? end - pos : count - done;
+
+    /* partly written block is written and its contents unknown */
+    h = pos == (off64_t) b * DEDUP_BLOCK && pos + (off64_t) len == end ? \
+      dedup_hash(p + done, len) : 0;
+    if (h != 0 && h == dedup_hashes[b]) {
+      __atomic_fetch_add(&dedup_saved, len, __ATOMIC_RELAXED);
+      if (pending) {
+        res = dedup_run(fd, p + run, done - run, offset + run);
+        if (res != (ssize_t) (done - run))
+          return res < 0 && run == 0 ? -1 : (ssize_t) run + (res > 0 ? res : 0);
+        pending = false;
+      }
+      continue;
+    }
+
+    dedup_hashes[b] = h;
+    if (! pending) {
+      run = done;
+      pending = true;
+    }
+  }
+
+  if (pending) {
+    res = dedup_run(fd, p + run, count - run, offset + run);
+    if (res != (ssize_t) (count - run))
+      return res < 0 && run == 0 ? -1 : (ssize_t) run + (res > 0 ? res : 0);
+  }
+
+  return count;
+}
+
+/* after engine wrote everything back, table gets mtime of image */
+void dedup_fini(void) {
+char tmp[PATH_MAX], mark;
+struct dedup_hdr hdr;
+struct stat64 st;
+off64_t pos = 0;
+int out;
+
+  if (dedup_hashes == NULL)
+    return;
+
+  /* another process wrote while table was ours */
+  if (p_pread64(dedup_lock, &mark, 1, 0) == 1) {
+    unlink(dedup_name);
+    p_ftruncate64(dedup_lock, 0);
+    report("dedup table dropped, image was written by another process");
+    return;
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, DEDUP_MAGIC, sizeof(hdr.magic));
+  hdr.version = 1;
+  hdr.block_size = DEDUP_BLOCK;
+  hdr.segment_offset = segment_offset;
+  hdr.segment_len = segment_len;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", dedup_name);
+  out = p_open64(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out < 0 || real_stat64(target_name, &st) != 0) {
+    dprint(LOG_ERR, true, "fawrap.so can't save dedup table %s", dedup_name);
+    if (out >= 0)
+      p_close(out);
+    return;
+  }
+  hdr.mtime_sec = st.st_mtim.tv_sec;
+  hdr.mtime_nsec = st.st_mtim.tv_nsec;
+  hdr.size = st.st_size;
+
+  if (write_all(out, &hdr, sizeof(hdr), &pos) || \
+      write_all(out, dedup_hashes, dedup_blocks * sizeof(*dedup_hashes), &pos) || \
+      p_close(out) != 0 || rename(tmp, dedup_name) != 0) {
+    dprint(LOG_ERR, true, "fawrap.so can't save dedup table %s", dedup_name);
+    unlink(tmp);
+    return;
+  }
+
+  report("dedup skipped %llu bytes of unchanged blocks, wrote %llu bytes", \
+    dedup_saved, dedup_written);
+}
+
+/* name of a file that may not exist yet made absolute, NULL on error */
+char *absolute_name(const char *name) {
+char path[PATH_MAX];
+
+  if (realpath(name, path) != NULL)
+    return strdup(path);
+  if (name[0] == '/')
+    return strdup(name);
+
+  if (getcwd(path, sizeof(path)) == NULL || strlen(path) + strlen(name) + 2 > sizeof(path))
+    return NULL;
+  strcat(path, "/");
+  strcat(path, name);
+  return strdup(path);
+}
+
+/* size with optional K, M or G suffix, true on error */
+bool parse_size(const char *str, off64_t *val) {
+char *end;
+
+  *val = strtoull(str, &end, 10);
+  switch (*end) {
+    case 'K': case 'k': *val <<= 10; end++; break;
+    case 'M': case 'm': *val <<= 20; end++; break;
+    case 'G': case 'g': *val <<= 30; end++; break;
+  }
+
+  return end == str || *end != '\0';
+}
+
+/* one name[=value] option from FILE, true on error */
+bool parse_option(char *opt) {
+char *val = strchr(opt, '=');
+off64_t size;
+char *p;
+
+  if (val != NULL)
+    *val++ = '\0';
+
+  if (strcmp(opt, "overlay") == 0 && val != NULL) {
+    overlay_name = val;
+    return set_engine(&overlay_engine);
+  } else if (strcmp(opt, "obs") == 0 && val != NULL) {
+    if (parse_size(val, &size) || size < 512 || size > (1 << 20))
+      return true;
+    overlay_bs = size;
+  } else if (strcmp(opt, "commit") == 0) {
+    overlay_commit = true;
+  } else if (strcmp(opt, "discard") == 0) {
+    overlay_discard = true;
+  } else if (strcmp(opt, "ram") == 0) {
+    if (val != NULL && parse_size(val, &ram_budget))
+      return true;
+    return set_engine(&ram_engine);
+  } else if (strcmp(opt, "ramzero") == 0) {
+    ram_zero = true;
+  } else if (strcmp(opt, "mmap") == 0) {
+    if (val == NULL)
+      mmap_hint = MMAP_NORMAL;
+    else if (strcmp(val, "populate") == 0)
+      mmap_hint = MMAP_POPULATE;
+    else if (strcmp(val, "random") == 0)
+      mmap_hint = MMAP_RANDOM;
+    else if (strcmp(val, "seq") == 0)
+      mmap_hint = MMAP_SEQ;
+    else
+      return true;
+    return set_engine(&mmap_engine);
+  } else if (strcmp(opt, "uring") == 0) {
+    if (val != NULL) {
+      uring_depth = atoi(val);
+      if (uring_depth < 1 || uring_depth > 4096)
+        return true;
+    }
+    return set_engine(&uring_engine);
+  } else if (strcmp(opt, "writebehind") == 0) {
+    if (val != NULL && (parse_size(val, &wb_arena) || wb_arena < (1 << 20)))
+      return true;
+    return set_engine(&wb_engine);
+  } else if (strcmp(opt, "sync") == 0 && val != NULL) {
+    if (strcmp(val, "pass") == 0)
+      sync_policy = SYNC_PASS;
+    else if (strcmp(val, "close") == 0)
+      sync_policy = SYNC_CLOSE;
+    else if (strcmp(val, "range") == 0)
+      sync_policy = SYNC_RANGE;
+    else if (strncmp(val, "coalesce", 8) == 0) {
+      sync_policy = SYNC_COALESCE;
+      if (val[8] == ':')
+        sync_ms = atol(val + 9);
+      else if (val[8] != '\0')
+        return true;
+    } else
+      return true;
+  } else if (strcmp(opt, "split") == 0) {
+    size = 4 << 20;
+    if (val != NULL && (parse_size(val, &size) || size < 4096))
+      return true;
+    split_chunk = size;
+  } else if (strcmp(opt, "readahead") == 0) {
+    ra_max = 8 << 20;
+    if (val != NULL && (parse_size(val, &ra_max) || ra_max < RA_MIN))
+      return true;
+  } else if (strcmp(opt, "shcache") == 0) {
+    shc_on = true;
+    if (val != NULL) {
+      p = strchr(val, ':');
+      if (p != NULL) {
+        *p++ = '\0';
+        shc_idle = atoi(p);
+        if (shc_idle < 1)
+          return true;
+      }
+      if (*val != '\0' && (parse_size(val, &shc_size) || shc_size < (1 << 20)))
+        return true;
+    }
+  } else if (strcmp(opt, "map") == 0 && val != NULL) {
+    map_name = val;
+    return set_engine(&map_engine);
+  } else if (strcmp(opt, "zcache") == 0 && val != NULL) {
+    if (parse_size(val, &zst_budget) || zst_budget < (1 << 20))
+      return true;
+  } else if (strcmp(opt, "export") == 0 && val != NULL) {
+    p = strrchr(val, ':');
+    if (p != NULL) {
+      *p++ = '\0';
+      export_level = atoi(p);
+      if (export_level < 1 || export_level > 19)
+        return true;
+    }
+    export_name = val;
+  } else if (strcmp(opt, "dirty") == 0 && val != NULL) {
+    p = strrchr(val, ':');
+    if (p != NULL && strcmp(p, ":data") == 0) {
+      *p = '\0';
+      dirty_data = true;
+    }
+    dirty_name = val;
+  } else if (strcmp(opt, "dedup") == 0 && val != NULL) {
+    dedup_name = val;
+  } else if (strcmp(opt, "raw") == 0) {
+    image_raw = true;
+  } else if (strcmp(opt, "mirror") == 0 && val != NULL) {
+    return mirror_parse(val);
+  } else if (strcmp(opt, "zero") == 0) {
+    zero_mode = true;
+  } else if (strcmp(opt, "extprefetch") == 0) {
+    ext_prefetch_on = true;
+  } else if (strcmp(opt, "profile") == 0 && val != NULL) {
+    /* absolute name, tool may change directory before exit */
+    profile_name = absolute_name(val);
+    if (profile_name == NULL)
+      return true;
+  } else if (strcmp(opt, "stats") == 0) {
+    show_stats = true;
+  } else if (strcmp(opt, "threads") == 0 && val != NULL) {
+    io_threads = atoi(val);
+    if (io_threads < 1 || io_threads > MAX_THREADS)
+      return true;
+  } else {
+    return true;
+  }
+
+  return false;
+}
+
+/* run when a shared library is unloaded */
+__attribute__((destructor)) void fini() {
+int i;
+
+  /* skipped flushes of fds left open by program */
+  for (i = 0; i < MAX_FD && sync_pending; i++) {
+    if (target_fd[i].fd != -1)
+      sync_close(target_fd[i].fd);
+  }
+
+  if (sync_calls > 0)
+    report("sync calls %llu, flushes %llu, avoided %llu, segment ranges %llu", \
+      sync_calls, sync_flushes, sync_avoided, sync_ranges);
+
+  if (split_chunk > 0)
+    report("split calls %llu into %llu chunks, done whole on busy pool %llu", \
+      split_calls, split_chunks, split_busy);
+
+  if (profile_name != NULL) {
+    trace_save();
+    report("profile replayed %zu blocks, recorded %zu", \
+      trace_replay_count, trace_count);
+  }
+
+  if (prefetch_started)
+    report("prefetched %llu bytes, dropped %llu requests", \
+      prefetch_bytes, prefetch_dropped);
+
+  /* copy is read through engine */
+  if (export_name != NULL && (export_started || any_target_fd()))
+    export_fini();
+
+  if (dirty_name != NULL && dirty_marked)
+    dirty_save();
+
+  if (engine->fini != NULL)
+    engine->fini();
+
+  if (mirror_count > 0)
+    mirror_fini();
 
-  for (i = 0; i < MAX_FD; i++) {
-    if (fd == target_fd[i]) {
-      target_fd[i] = 0;
-      return;
-    }
-  }
+  if (dedup_name != NULL)
+    dedup_fini();
 
-  dprint(LOG_ERR, true, "%s(error line %d)", __FUNCTION__, __LINE__);
-  exit(1);
-}
+  if (shc_mem != NULL)
+    shc_fini();
+
+  if (zero_mode)
+    report("zero reads %llu bytes without I/O", zero_bytes);
 
-/* run when a shared library is unloaded */
-__attribute__((destructor)) void fini() {
   if (debug_stream != NULL)
     fclose(debug_stream);
 }
 
 /* run when a shared library is loaded */
 __attribute__((constructor)) void init() {
+char canon[PATH_MAX];
+struct stat64 st;
 char *args;
 char *p;
 int i;
 
   for (i = 0; i < MAX_FD; i++)
-    target_fd[i] = 0;   /*  init fd array */
+    target_fd[i].fd = -1;   /*  init fd array */
 
   DEFINE_DLSYM(open);
   DEFINE_DLSYM(open64);
@@ -181,8 +5903,23 @@ int i;
   DEFINE_DLSYM(__xstat64);
   DEFINE_DLSYM(fstat);
   DEFINE_DLSYM(fstat64);
+  DEFINE_DLSYM(__fxstat);
   DEFINE_DLSYM(__fxstat64);
-  DEFINE_DLSYM(fallocate);
+  DEFINE_DLSYM(stat);
+  DEFINE_DLSYM(stat64);
+  DEFINE_DLSYM(fstatat);
+  DEFINE_DLSYM(fstatat64);
+  DEFINE_DLSYM(statx);
+  DEFINE_DLSYM(ftruncate);
+  DEFINE_DLSYM(ftruncate64);
+  DEFINE_DLSYM(fallocate64);
+  DEFINE_DLSYM(fsync);
+  DEFINE_DLSYM(fdatasync);
+  DEFINE_DLSYM(sync);
+  DEFINE_DLSYM(syncfs);
+  DEFINE_DLSYM(ioctl);
+  DEFINE_DLSYM(read);
+  DEFINE_DLSYM(write);
   DEFINE_DLSYM(pread64);
   DEFINE_DLSYM(pwrite64);
 
@@ -193,6 +5930,8 @@ int i;
     exit(1);
   }
 
+  /* keep environment intact for child processes */
+  args = strdup(args);
   target_name = strtok(args, ",");
 
   p = strtok(NULL, ",");
@@ -209,12 +5948,16 @@ int i;
   } else
     segment_len = strtoull(p, NULL, 10);
 
-  p = strtok(NULL, ",");
-  if (p != NULL) {
+  /* debug level and options in any order */
+  while ((p = strtok(NULL, ",")) != NULL) {
     if (strcmp(p, "d") == 0)
       debug_level = LOG_DBG;
     else if (strcmp(p, "i") == 0)
       debug_level = LOG_INFO;
+    else if (parse_option(p)) {
+      dprint(LOG_ERR, true, "fawrap.so bad option: %s", p);
+      exit(1);
+    }
   }
 
   if (debug_level >= LOG_INFO) {
@@ -227,7 +5970,95 @@ int i;
 
   dprint(LOG_INFO, true, "fawrap.so target file: %s", target_name);
   dprint(LOG_INFO, true, "fawrap.so      offset: %llu", segment_offset);
-  dprint(LOG_INFO, true, "fawrap.so         len: %llu\n", segment_len);
+  dprint(LOG_INFO, true, "fawrap.so         len: %llu", segment_len);
+
+  /* match by identity, names are only a shortcut */
+  add_alias(target_name);
+  if (realpath(target_name, canon) != NULL)
+    add_alias(canon);
+  else
+    snprintf(canon, sizeof(canon), "%s", target_name);
+
+  if (real_stat64(target_name, &st) == 0)
+    set_identity(st.st_dev, st.st_ino);
+
+  /* qcow2 and zstd images are read through their tables,
+     a device is taken raw */
+  if (! image_raw && qcow_probe()) {
+    if (set_engine(&qcow_engine))
+      exit(1);
+  } else if (! image_raw && zst_probe()) {
+    if (set_engine(&zst_engine))
+      exit(1);
+  } else if (blkdev_init())
+    exit(1);
+
+  /* length 0 takes rest of a plain image file, engines of other
+     images size it from their tables */
+  if (segment_len == 0 && engine != &map_engine && engine != &qcow_engine && \
+      engine != &zst_engine && real_stat64(target_name, &st) == 0 && \
+      S_ISREG(st.st_mode) && st.st_size > segment_offset)
+    segment_len = st.st_size - segment_offset;
+
+  if (zero_mode && zero_init()) {
+    dprint(LOG_ERR, true, "fawrap.so zero mode failed");
+    exit(1);
+  }
+
+  if (engine->init != NULL && engine->init()) {
+    dprint(LOG_ERR, true, "fawrap.so %s engine failed", engine->name);
+    exit(1);
+  }
+
+  if (mirror_count > 0 && mirror_init()) {
+    dprint(LOG_ERR, true, "fawrap.so mirrors failed");
+    exit(1);
+  }
+
+  /* other engines keep state that is not safe for parallel calls */
+  if (split_chunk > 0 && ((engine != &direct_engine && engine != &map_engine) || mmap_short)) {
+    dprint(LOG_ERR, true, "fawrap.so split can't be combined with %s", engine->name);
+    exit(1);
+  }
+
+  /* cache holds the image as other processes see it */
+  if (shc_on && (engine != &direct_engine || mmap_short || shc_init())) {
+    dprint(LOG_ERR, true, "fawrap.so shared cache can't be used with %s", engine->name);
+    exit(1);
+  }
+
+  if (export_name != NULL && zst_load()) {
+    dprint(LOG_ERR, true, "fawrap.so export needs libzstd");
+    exit(1);
+  }
+
+  if (dirty_name != NULL && \
+      bitmap_alloc(&dirty_map, (segment_len + DELTA_BLOCK - 1) / DELTA_BLOCK)) {
+    dprint(LOG_ERR, true, "fawrap.so dirty bitmap failed");
+    exit(1);
+  }
+
+  if (dedup_name != NULL && dedup_init()) {
+    dprint(LOG_ERR, true, "fawrap.so dedup table %s failed", dedup_name);
+    exit(1);
+  }
+
+  if (profile_name != NULL && trace_init(canon)) {
+    dprint(LOG_ERR, true, "fawrap.so profile %s failed", profile_name);
+    exit(1);
+  }
+
+  if (ext_prefetch_on && ext_init()) {
+    dprint(LOG_ERR, true, "fawrap.so reading ext metadata failed");
+    exit(1);
+  }
+
+  if ((ra_max > 0 || trace_replay_count > 0 || ext_count > 0) && prefetch_init()) {
+    dprint(LOG_ERR, true, "fawrap.so prefetch thread failed");
+    exit(1);
+  }
+
+  dprint(LOG_INFO, true, "");
 }
 
 /* open and possibly create a file */
@@ -245,14 +6076,11 @@ int res;
   /* if O_CREAT in flags is not specified
      then mode is ignored */
   res = p_open(path, flags, mode);
+  opened_fd(res, path);
+
   dprint(LOG_DBG, check_name(path), "%s(%s, %d, %d) => %d", \
     __FUNCTION__, path, flags, mode, res);
 
-  if (check_name(path) && add_fd(res)) {
-    dprint(LOG_ERR, check_name(path), "%s(error line %d)", __FUNCTION__, __LINE__);
-    exit(1);
-  }
-
   return res;
 }
 
@@ -269,14 +6097,11 @@ int res;
   }
 
   res = p_open64(path, flags, mode);
+  opened_fd(res, path);
+
   dprint(LOG_DBG, check_name(path), "%s(%s, %d, %d) => %d", \
     __FUNCTION__, path, flags, mode, res);
 
-  if (check_name(path) && add_fd(res)) {
-    dprint(LOG_ERR, check_name(path), "%s(error line %d)", __FUNCTION__, __LINE__);
-    exit(1);
-  }
-
   return res;
 }
 
@@ -286,27 +6111,45 @@ int __open64_2(const char *path, int flags) {
 int res;
 
   res = p___open64_2(path, flags);
+  opened_fd(res, path);
+
   dprint(LOG_DBG, check_name(path), "%s(%s, %d) => %d", \
     __FUNCTION__, path, flags, res);
 
-  if (check_name(path) && add_fd(res)) {
-    dprint(LOG_ERR, check_name(path), "%s(error line %d)", __FUNCTION__, __LINE__);
-    exit(1);
-  }
-
   return res;
 }
 
 /* close a file descriptor */
 int close(int fd) {
+bool our;
+int err;
 int res;
 
+  our = find_fd(fd) != NULL;
+  if (our) {
+    sync_close(fd);
+    if ((engine->close != NULL && engine->close(fd) != 0) || \
+        (mirror_count > 0 && mirror_barrier() != 0)) {
+      err = errno;
+      p_close(fd);
+      remove_fd(fd);
+      errno = err;
+      return -1;
+    }
+  }
+
   res = p_close(fd);
-  dprint(LOG_DBG, check_fd(fd), "%s(%d) => %d", \
+  dprint(LOG_DBG, our, "%s(%d) => %d", \
     __FUNCTION__, fd, res);
 
-  if (check_fd(fd))
+  if (our)
     remove_fd(fd);
+  else if (fd >= 0 && fd < FD_MAP_SIZE)
+    fd_map[fd] = FD_NONE;
+
+  /* copy can be made while program winds down */
+  if (our && export_name != NULL && ! any_target_fd())
+    export_start();
 
   return res;
 }
@@ -386,126 +6229,589 @@ off64_t offset_new = offset;
 
 /* get file status */
 int __xstat(int x, const char *path, struct stat *buf) {
+bool our;
 int res;
 
   res = p___xstat(x, path, buf);
-  buf->st_size = segment_len;
+  our = res == 0 && check_path(path, buf->st_dev, buf->st_ino);
+  if (our)
+    buf->st_size = segment_len;
 
-  dprint(LOG_DBG, check_name(path), "%s(%s, st_mode=%d, st_size=%ld, ...) => %d", \
+  dprint(LOG_DBG, our, "%s(%s, st_mode=%d, st_size=%ld, ...) => %d", \
     __FUNCTION__, path, buf->st_mode, buf->st_size, res);
   return res;
 }
 
 /* get file status */
 int __xstat64(int x, const char *path, struct stat64 *buf) {
+bool our;
 int res;
 
   res = p___xstat64(x, path, buf);
-  buf->st_size = segment_len;
+  our = res == 0 && check_path(path, buf->st_dev, buf->st_ino);
+  if (our)
+    buf->st_size = segment_len;
+
+  dprint(LOG_DBG, our, "%s(%s, st_mode=%d, st_size=%lld, ...) => %d", \
+    __FUNCTION__, path, buf->st_mode, buf->st_size, res);
+  return res;
+}
+
+/* get file status (glibc >= 2.33) */
+int stat(const char *path, struct stat *buf) {
+bool our;
+int res;
+
+  res = real_stat(path, buf);
+  our = res == 0 && check_path(path, buf->st_dev, buf->st_ino);
+  if (our)
+    buf->st_size = segment_len;
 
-  dprint(LOG_DBG, check_name(path), "%s(%s, st_mode=%d, st_size=%lld, ...) => %d", \
+  dprint(LOG_DBG, our, "%s(%s, st_mode=%d, st_size=%ld, ...) => %d", \
+    __FUNCTION__, path, buf->st_mode, buf->st_size, res);
+  return res;
+}
+
+/* get file status (glibc >= 2.33) */
+int stat64(const char *path, struct stat64 *buf) {
+bool our;
+int res;
+
+  res = real_stat64(path, buf);
+  our = res == 0 && check_path(path, buf->st_dev, buf->st_ino);
+  if (our)
+    buf->st_size = segment_len;
+
+  dprint(LOG_DBG, our, "%s(%s, st_mode=%d, st_size=%lld, ...) => %d", \
     __FUNCTION__, path, buf->st_mode, buf->st_size, res);
   return res;
 }
 
 /* get file status */
 int fstat(int fd, struct stat *buf) {
-int res;
+int state = fd_state(fd);
+bool our = false;
+int res = 0;
 
-  res = p_fstat(fd, buf);
-  buf->st_size = (off_t) segment_len;
+  if (state == FD_NONE) {
+    res = real_fstat(fd, buf);
+  } else if (stat_load(state, buf, sizeof(*buf))) {
+    our = true;
+  } else {
+    res = real_fstat(fd, buf);
+    our = res == 0 && stat_fd(fd, state, buf->st_dev, buf->st_ino);
+    if (our) {
+      buf->st_size = (off_t) segment_len;
+      stat_store(buf, sizeof(*buf));
+    }
+  }
 
-  dprint(LOG_DBG, check_fd(fd), "%s(%d, st_mode=%d, st_size=%ld, ...) => %d", \
+  dprint(LOG_DBG, our, "%s(%d, st_mode=%d, st_size=%ld, ...) => %d", \
     __FUNCTION__, fd, buf->st_mode, buf->st_size, res);
   return res;
 }
 
 /* get file status */
 int fstat64(int fd, struct stat64 *buf) {
-int res;
+int state = fd_state(fd);
+bool our = false;
+int res = 0;
+
+  if (state == FD_NONE) {
+    res = real_fstat64(fd, buf);
+  } else if (stat_load(state, buf, sizeof(*buf))) {
+    our = true;
+  } else {
+    res = real_fstat64(fd, buf);
+    our = res == 0 && stat_fd(fd, state, buf->st_dev, buf->st_ino);
+    if (our) {
+      buf->st_size = segment_len;
+      stat_store(buf, sizeof(*buf));
+    }
+  }
+
+  dprint(LOG_DBG, our, "%s(%d, st_mode=%d, st_size=%lld, ...) => %d", \
+    __FUNCTION__, fd, buf->st_mode, buf->st_size, res);
+  return res;
+}
+
+/* get file status */
+int __fxstat(int vers, int fd, struct stat *buf) {
+int state = fd_state(fd);
+bool our = false;
+int res = 0;
 
-  res = p_fstat64(fd, buf);
-  buf->st_size = segment_len;
+  if (state == FD_NONE) {
+    res = p___fxstat(vers, fd, buf);
+  } else if (stat_load(state, buf, sizeof(*buf))) {
+    our = true;
+  } else {
+    res = p___fxstat(vers, fd, buf);
+    our = res == 0 && stat_fd(fd, state, buf->st_dev, buf->st_ino);
+    if (our) {
+      buf->st_size = (off_t) segment_len;
+      stat_store(buf, sizeof(*buf));
+    }
+  }
 
-  dprint(LOG_DBG, check_fd(fd), "%s(%d, st_mode=%d, st_size=%lld, ...) => %d", \
+  dprint(LOG_DBG, our, "%s(%d, st_mode=%d, st_size=%ld, ...) => %d", \
     __FUNCTION__, fd, buf->st_mode, buf->st_size, res);
   return res;
 }
 
 /* get file status */
 int __fxstat64(int vers, int fd, struct stat64 *buf) {
-int res;
+int state = fd_state(fd);
+bool our = false;
+int res = 0;
 
-  res = p___fxstat64(vers, fd, buf);
-  buf->st_size = segment_len;
+  if (state == FD_NONE) {
+    res = p___fxstat64(vers, fd, buf);
+  } else if (stat_load(state, buf, sizeof(*buf))) {
+    our = true;
+  } else {
+    res = p___fxstat64(vers, fd, buf);
+    our = res == 0 && stat_fd(fd, state, buf->st_dev, buf->st_ino);
+    if (our) {
+      buf->st_size = segment_len;
+      stat_store(buf, sizeof(*buf));
+    }
+  }
 
-  dprint(LOG_DBG, check_fd(fd), "%s(%d, st_mode=%d, st_size=%lld, ...) => %d", \
+  dprint(LOG_DBG, our, "%s(%d, st_mode=%d, st_size=%lld, ...) => %d", \
     __FUNCTION__, fd, buf->st_mode, buf->st_size, res);
   return res;
 }
 
+/* get file status relative to a directory fd (newfstatat) */
+int fstatat(int dirfd, const char *path, struct stat *buf, int flags) {
+bool our;
+int res;
+
+  res = p_fstatat(dirfd, path, buf, flags);
+  if (res == 0 && (flags & AT_EMPTY_PATH) && path[0] == '\0')
+    our = stat_fd(dirfd, fd_state(dirfd), buf->st_dev, buf->st_ino);
+  else
+    our = res == 0 && check_path(path, buf->st_dev, buf->st_ino);
+
+  if (our)
+    buf->st_size = segment_len;
+
+  dprint(LOG_DBG, our, "%s(%d, %s, st_mode=%d, st_size=%ld, %d) => %d", \
+    __FUNCTION__, dirfd, path, buf->st_mode, buf->st_size, flags, res);
+  return res;
+}
+
+/* get file status relative to a directory fd (newfstatat) */
+int fstatat64(int dirfd, const char *path, struct stat64 *buf, int flags) {
+bool our;
+int res;
+
+  res = p_fstatat64(dirfd, path, buf, flags);
+  if (res == 0 && (flags & AT_EMPTY_PATH) && path[0] == '\0')
+    our = stat_fd(dirfd, fd_state(dirfd), buf->st_dev, buf->st_ino);
+  else
+    our = res == 0 && check_path(path, buf->st_dev, buf->st_ino);
+
+  if (our)
+    buf->st_size = segment_len;
+
+  dprint(LOG_DBG, our, "%s(%d, %s, st_mode=%d, st_size=%lld, %d) => %d", \
+    __FUNCTION__, dirfd, path, buf->st_mode, buf->st_size, flags, res);
+  return res;
+}
+
+/* get file status (extended) */
+int statx(int dirfd, const char *path, int flags, unsigned int mask, struct statx *buf) {
+dev_t dev;
+bool our;
+int res;
+
+  res = p_statx(dirfd, path, flags, mask, buf);
+  dev = makedev(buf->stx_dev_major, buf->stx_dev_minor);
+  if (res == 0 && (flags & AT_EMPTY_PATH) && path[0] == '\0')
+    our = stat_fd(dirfd, fd_state(dirfd), dev, buf->stx_ino);
+  else
+    our = res == 0 && check_path(path, dev, buf->stx_ino);
+
+  if (our && (buf->stx_mask & STATX_SIZE))
+    buf->stx_size = segment_len;
+
+  dprint(LOG_DBG, our, "%s(%d, %s, %d, %u, stx_size=%llu) => %d", \
+    __FUNCTION__, dirfd, path, flags, mask, buf->stx_size, res);
+  return res;
+}
+
+/* truncate a file, segment size is fixed so the
+   target can only be "truncated" to within it */
+int ftruncate(int fd, off_t length) {
+int res;
+
+  if (check_fd(fd)) {
+    stat_invalidate();
+    if (length < 0 || length > segment_len) {
+      errno = length < 0 ? EINVAL : EFBIG;
+      res = -1;
+    } else {
+      res = 0;
+    }
+  } else {
+    res = p_ftruncate(fd, length);
+  }
+
+  dprint(LOG_DBG, check_fd(fd), "%s(%d, %ld) => %d", \
+    __FUNCTION__, fd, length, res);
+  return res;
+}
+
+/* truncate a file */
+int ftruncate64(int fd, off64_t length) {
+int res;
+
+  if (check_fd(fd)) {
+    stat_invalidate();
+    if (length < 0 || length > segment_len) {
+      errno = length < 0 ? EINVAL : EFBIG;
+      res = -1;
+    } else {
+      res = 0;
+    }
+  } else {
+    res = p_ftruncate64(fd, length);
+  }
+
+  dprint(LOG_DBG, check_fd(fd), "%s(%d, %lld) => %d", \
+    __FUNCTION__, fd, length, res);
+  return res;
+}
+
+/* target fd may be written through engines that don't use it */
+bool check_writable(int fd) {
+struct target *t = find_fd(fd);
+
+  if (t != NULL && (t->flags & O_ACCMODE) == O_RDONLY) {
+    errno = EBADF;
+    return false;
+  }
+
+  return true;
+}
+
+/* O_DIRECT on target needs block aligned buffer, size and offset,
+   checked here because some engines never reach the kernel */
+bool check_direct(int fd, const void *buf, size_t count, off64_t offset) {
+struct target *t = find_fd(fd);
+
+  if (t != NULL && t->flags & O_DIRECT && ((uintptr_t) buf % target_lbs != 0 || \
+      count % target_lbs != 0 || offset % target_lbs != 0)) {
+    errno = EINVAL;
+    return false;
+  }
+
+  return true;
+}
+
+/* after a range of segment was deallocated or zeroed by engine */
+int segment_fallocated(int mode, off64_t offset, off64_t len) {
+  if (export_name != NULL)
+    __atomic_fetch_add(&export_gen, 1, __ATOMIC_RELEASE);
+  if (dirty_name != NULL && mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
+    dirty_mark(offset, len);
+  if (dedup_name != NULL && mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
+    dedup_forget(offset, len);
+  if (shc_mem != NULL && mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
+    shc_write(NULL, offset, len, false);
+  if (zero_mode && mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
+    zero_discard(offset, len);
+  if (mirror_count > 0)
+    return mirror_fallocate(mode, offset, len);
+
+  return 0;
+}
+
 /* manipulate file space */
-int fallocate(int fd, int mode, off_t offset, off_t len) {
-off_t res;
-off_t offset_new = offset;
+int fallocate64(int fd, int mode, off64_t offset, off64_t len) {
+int res;
 
   if (check_fd(fd)) {
-    if (offset_new > segment_len) {
+    if (offset < 0 || len <= 0 || offset > segment_len) {
       dprint(LOG_ERR, true, "%s offset out of bounds", __FUNCTION__);
-      return ENOSPC;
+      errno = offset > segment_len ? ENOSPC : EINVAL;
+      return -1;
     }
 
-    /* we have to move by segment_offset */
-    offset_new += segment_offset;
-  }
+    /* never past segment end */
+    if (len > segment_len - offset)
+      len = segment_len - offset;
 
-  res = p_fallocate(fd, mode, offset_new, len);
+    stat_invalidate();
+    /* table is checked against mtime before punch changes it */
+    if (dedup_name != NULL)
+      dedup_claim();
+    res = check_writable(fd) ? engine->fallocate(fd, mode, offset, len) : -1;
+    if (res == 0)
+      res = segment_fallocated(mode, offset, len);
+  } else
+    res = p_fallocate64(fd, mode, offset, len);
 
-  dprint(LOG_DBG, check_fd(fd), "%s(%d, %d, %ld, %ld) => %ld", \
+  dprint(LOG_DBG, check_fd(fd), "%s(%d, %d, %lld, %lld) => %d", \
     __FUNCTION__, fd, mode, offset, len, res);
   return res;
 }
 
+/* manipulate file space */
+int fallocate(int fd, int mode, off_t offset, off_t len) {
+  return fallocate64(fd, mode, offset, len);
+}
+
 /* read from file descriptor at a given offset */
 ssize_t pread64(int fd, void *buf, size_t count, off64_t offset) {
 ssize_t res;
-off64_t offset_new = offset;
 
   if (check_fd(fd)) {
-    if (offset_new > segment_len) {
+    if (offset < 0 || offset > segment_len) {
       dprint(LOG_ERR, true, "%s offset out of bounds", __FUNCTION__);
-      return ENOSPC;
+      errno = offset < 0 ? EINVAL : ENOSPC;
+      return -1;
     }
 
-    /* we have to move by segment_offset */
-    offset_new += segment_offset;
-  }
+    if (! check_direct(fd, buf, count, offset))
+      return -1;
+
+    /* never past segment end */
+    if (count > (size_t) (segment_len - offset))
+      count = segment_len - offset;
 
-  res = p_pread64(fd, buf, count, offset_new);
+    if (zero_mode)
+      res = zero_pread(fd, buf, count, offset);
+    else if (shc_mem != NULL)
+      res = shc_pread(fd, buf, count, offset);
+    else
+      res = target_pread(fd, buf, count, offset);
+    if (ra_max > 0 && res > 0)
+      readahead_access(find_fd(fd), offset, res);
+    if (profile_name != NULL && res > 0)
+      trace_access(offset, res);
+  } else
+    res = p_pread64(fd, buf, count, offset);
 
   dprint(LOG_DBG, check_fd(fd), "%s(%d, %d, %llu) => %d", \
     __FUNCTION__, fd, count, offset, res);
   return res;
 }
 
+/* read from file descriptor at a given offset */
+ssize_t pread(int fd, void *buf, size_t count, off_t offset) {
+  return pread64(fd, buf, count, offset);
+}
+
 /* write to a file descriptor at a given offset */
 ssize_t pwrite64(int fd, const void *buf, size_t count, off64_t offset) {
 ssize_t res;
-off64_t offset_new = offset;
 
   if (check_fd(fd)) {
-    if (offset_new > segment_len) {
+    if (offset < 0 || offset > segment_len || \
+        (offset == segment_len && count > 0)) {
       dprint(LOG_ERR, true, "%s offset out of bounds", __FUNCTION__);
-      return EINVAL;
+      errno = offset < 0 ? EINVAL : ENOSPC;
+      return -1;
     }
 
-    /* we have to move by segment_offset */
-    offset_new += segment_offset;
-  }
+    if (! check_direct(fd, buf, count, offset))
+      return -1;
+
+    /* never past segment end */
+    if (count > (size_t) (segment_len - offset))
+      count = segment_len - offset;
 
-  res = p_pwrite64(fd, buf, count, offset_new);
+    stat_invalidate();
+    if (! check_writable(fd) || (mirror_count > 0 && mirror_error() != 0))
+      res = -1;
+    else if (dedup_name != NULL && dedup_claim())
+      res = dedup_pwrite(fd, buf, count, offset);
+    else
+      res = target_pwrite(fd, buf, count, offset);
+    if (shc_mem != NULL && res > 0)
+      shc_write(buf, offset, res, true);
+    if (zero_mode && res > 0)
+      zero_write(offset, res);
+    if (mirror_count > 0 && res > 0 && mirror_write(buf, res, offset) != 0)
+      res = -1;
+    if (export_name != NULL && res > 0)
+      __atomic_fetch_add(&export_gen, 1, __ATOMIC_RELEASE);
+    if (dirty_name != NULL && dedup_hashes == NULL && res > 0)
+      dirty_mark(offset, res);
+    if (dedup_name != NULL && dedup_hashes == NULL && res > 0)
+      dedup_foreign();
+  } else
+    res = p_pwrite64(fd, buf, count, offset);
 
   dprint(LOG_DBG, check_fd(fd), "%s(%d, %d, %llu) => %d", \
     __FUNCTION__, fd, count, offset, res);
   return res;
 }
+
+/* write to a file descriptor at a given offset */
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset) {
+  return pwrite64(fd, buf, count, offset);
+}
+
+/* read from a file descriptor, at its file offset */
+ssize_t read(int fd, void *buf, size_t count) {
+off64_t pos;
+ssize_t res;
+
+  if (! check_fd(fd))
+    return p_read(fd, buf, count);
+
+  /* file offset of a target fd is kept moved by segment_offset */
+  pos = p_lseek64(fd, 0, SEEK_CUR);
+  if (pos < 0)
+    return -1;
+
+  res = pread64(fd, buf, count, pos - segment_offset);
+  if (res > 0)
+    p_lseek64(fd, pos + res, SEEK_SET);
+
+  return res;
+}
+
+/* write to a file descriptor, at its file offset */
+ssize_t write(int fd, const void *buf, size_t count) {
+off64_t pos;
+ssize_t res;
+
+  if (! check_fd(fd))
+    return p_write(fd, buf, count);
+
+  pos = p_lseek64(fd, 0, SEEK_CUR);
+  if (pos < 0)
+    return -1;
+
+  res = pwrite64(fd, buf, count, pos - segment_offset);
+  if (res > 0)
+    p_lseek64(fd, pos + res, SEEK_SET);
+
+  return res;
+}
+
+/* synchronize a file's state with storage */
+int fsync(int fd) {
+int res;
+
+  if (check_fd(fd))
+    res = sync_target(fd, false, NULL, 0);
+  else
+    res = p_fsync(fd);
+
+  dprint(LOG_DBG, check_fd(fd), "%s(%d) => %d", __FUNCTION__, fd, res);
+  return res;
+}
+
+/* synchronize a file's data with storage */
+int fdatasync(int fd) {
+int res;
+
+  if (check_fd(fd))
+    res = sync_target(fd, true, NULL, 0);
+  else
+    res = p_fdatasync(fd);
+
+  dprint(LOG_DBG, check_fd(fd), "%s(%d) => %d", __FUNCTION__, fd, res);
+  return res;
+}
+
+/* commit filesystem caches to disk, while target is open
+   it follows the target policy */
+void sync(void) {
+  if (any_target_fd())
+    sync_target(-1, false, sync_all, 0);
+  else
+    p_sync();
+
+  dprint(LOG_DBG, false, "%s()", __FUNCTION__);
+}
+
+/* commit caches of filesystem containing fd */
+int syncfs(int fd) {
+int res;
+
+  if (check_fd(fd))
+    res = sync_target(-1, false, p_syncfs, fd);
+  else
+    res = p_syncfs(fd);
+
+  dprint(LOG_DBG, check_fd(fd), "%s(%d) => %d", __FUNCTION__, fd, res);
+  return res;
+}
+
+/* range ioctls of a block device target are moved into segment,
+   its size is the segment */
+int segment_ioctl(int fd, unsigned long request, void *arg) {
+uint64_t range[2];
+int mode;
+
+  switch (request) {
+  case BLKGETSIZE64:
+    *(uint64_t *) arg = segment_len;
+    return 0;
+
+  case BLKGETSIZE:
+    *(unsigned long *) arg = segment_len >> 9;
+    return 0;
+
+  case BLKDISCARD:
+  case BLKSECDISCARD:
+  case BLKZEROOUT:
+    memcpy(range, arg, sizeof(range));
+    if (range[0] % target_lbs != 0 || range[1] % target_lbs != 0 || \
+        range[0] > (uint64_t) segment_len || range[1] > segment_len - range[0]) {
+      errno = EINVAL;
+      return -1;
+    }
+    if (! check_writable(fd))
+      return -1;
+    stat_invalidate();
+
+    mode = request == BLKZEROOUT ? FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE : \
+      FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+
+    /* other engines keep data elsewhere, they get a fallocate */
+    if (engine != &direct_engine)
+      return range[1] == 0 ? 0 : fallocate64(fd, mode, range[0], range[1]);
+
+    if (dedup_name != NULL)
+      dedup_claim();
+    range[0] += segment_offset;
+    if (p_ioctl(fd, request, range) != 0)
+      return -1;
+    return segment_fallocated(mode, range[0] - segment_offset, range[1]);
+
+  case BLKFLSBUF:
+    if (engine != &direct_engine && engine->flush(fd, false) != 0)
+      return -1;
+    return p_ioctl(fd, request, arg);
+  }
+
+  return p_ioctl(fd, request, arg);
+}
+
+/* control device */
+int ioctl(int fd, unsigned long request, ...) {
+va_list args;
+void *arg;
+int res;
+
+  va_start(args, request);
+  arg = va_arg(args, void *);
+  va_end(args);
+
+  if (target_blkdev && check_fd(fd))
+    res = segment_ioctl(fd, request, arg);
+  else
+    res = p_ioctl(fd, request, arg);
+
+  dprint(LOG_DBG, check_fd(fd), "%s(%d, 0x%lx) => %d", \
+    __FUNCTION__, fd, request, res);
+  return res;
+}
@@ -0,0 +1,21 @@
+#!/bin/sh
+# second identical mke2fs (4K blocks, as in the table) skips blocks
+# it would write unchanged, the filesystem must still check clean
+
+set -e
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+lib=$(cd "$(dirname "$0")/.." && pwd)/fawrap.so
+seg=$dir/disk.img,1048576,33554944
+mkfs="mke2fs -q -F -t ext4 -b 4096 -U 4f2c1a2e-5d4b-4c3a-9e1f-0a1b2c3d4e5f \
+  -E nodiscard,hash_seed=4f2c1a2e-5d4b-4c3a-9e1f-0a1b2c3d4e5f"
+export E2FSPROGS_FAKE_TIME=1700000000
+
+truncate -s 40M "$dir/disk.img"
+FILE=$seg,dedup=$dir/disk.hash LD_PRELOAD=$lib $mkfs "$dir/disk.img"
+skipped=$(FILE=$seg,dedup=$dir/disk.hash,stats LD_PRELOAD=$lib $mkfs "$dir/disk.img" 2>&1 | \
+  sed -n 's/.*dedup skipped \([0-9]*\) bytes.*/\1/p')
+test "$skipped" -gt 0
+
+FILE=$seg LD_PRELOAD=$lib e2fsck -fn "$dir/disk.img" > /dev/null 2>&1
+echo "dedup: ok"
@@ -0,0 +1,30 @@
+#!/bin/sh
+# blocks changed on a copy of the image and recorded in a delta bring
+# the old image up to date, from the delta itself or from the copy
+
+set -e
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+top=$(cd "$(dirname "$0")/.." && pwd)
+lib=$top/fawrap.so
+seg=$dir/new.img,1048576,33554944
+
+truncate -s 40M "$dir/new.img"
+FILE=$seg LD_PRELOAD=$lib mke2fs -q -F -t ext4 "$dir/new.img"
+cp "$dir/new.img" "$dir/old.img"
+
+# delta with data of a session of two tools
+FILE=$seg,dirty=$dir/data.delta:data LD_PRELOAD=$lib tune2fs -L first "$dir/new.img" > /dev/null
+FILE=$seg,dirty=$dir/data.delta:data LD_PRELOAD=$lib mke2fs -q -F -t ext4 "$dir/new.img"
+"$top/fawrap-apply" "$dir/data.delta" "$dir/old.img,1048576" > /dev/null
+cmp "$dir/new.img" "$dir/old.img"
+
+# delta without data, blocks taken from updated image
+cp "$dir/new.img" "$dir/old.img"
+FILE=$seg,dirty=$dir/plain.delta LD_PRELOAD=$lib tune2fs -L second "$dir/new.img" > /dev/null
+FILE=$seg,dirty=$dir/plain.delta LD_PRELOAD=$lib mke2fs -q -F -t ext4 "$dir/new.img"
+"$top/fawrap-apply" -s "$dir/new.img,1048576" "$dir/plain.delta" "$dir/old.img,1048576" > /dev/null
+cmp "$dir/new.img" "$dir/old.img"
+
+FILE=$dir/old.img,1048576,33554944 LD_PRELOAD=$lib e2fsck -fn "$dir/old.img" > /dev/null 2>&1
+echo "dirty: ok"
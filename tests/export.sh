@@ -0,0 +1,19 @@
+#!/bin/sh
+# compressed copy written when mke2fs closes the target must hold the
+# segment byte for byte
+
+set -e
+command -v zstd > /dev/null || { echo "export: skipped, no zstd"; exit 0; }
+/sbin/ldconfig -p | grep -q libzstd.so.1 || { echo "export: skipped, no libzstd"; exit 0; }
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+lib=$(cd "$(dirname "$0")/.." && pwd)/fawrap.so
+seg=$dir/disk.img,1048576,33554944
+
+truncate -s 40M "$dir/disk.img"
+FILE=$seg,export=$dir/disk.img.zst LD_PRELOAD=$lib mke2fs -q -F -t ext4 "$dir/disk.img"
+
+dd if="$dir/disk.img" bs=512 skip=2048 count=65537 status=none > "$dir/seg"
+zstd -q -d -c "$dir/disk.img.zst" > "$dir/copy"
+cmp "$dir/seg" "$dir/copy"
+echo "export: ok"
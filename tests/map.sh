@@ -0,0 +1,28 @@
+#!/bin/sh
+# filesystem on a segment made of a linear extent and two stripes,
+# checked through the table and its parts compared with the files
+
+set -e
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+lib=$(cd "$(dirname "$0")/.." && pwd)/fawrap.so
+seg=$dir/disk.img,0,0
+
+touch "$dir/disk.img"
+truncate -s 9M "$dir/a.img"
+truncate -s 12M "$dir/b.img" "$dir/c.img"
+cat > "$dir/table" <<END
+0      16384  linear  $dir/a.img  2048
+16384  49152  striped 2 128 $dir/b.img 0 $dir/c.img 0
+END
+
+FILE=$seg,map=$dir/table LD_PRELOAD=$lib mke2fs -q -F -t ext4 "$dir/disk.img"
+test "$(stat -c %s "$dir/disk.img")" -eq 0
+
+FILE=$seg,map=$dir/table LD_PRELOAD=$lib e2fsck -fn "$dir/disk.img" > /dev/null 2>&1
+FILE=$seg,map=$dir/table,split=64K LD_PRELOAD=$lib e2fsck -fn "$dir/disk.img" > /dev/null 2>&1
+
+# superblock is in the linear extent, 1K into the segment
+FILE=$dir/a.img,1048576,33554432 LD_PRELOAD=$lib dumpe2fs -h "$dir/a.img" 2>/dev/null | \
+  grep -q "^Block count: *32768$"
+echo "map: ok"
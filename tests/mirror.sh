@@ -0,0 +1,16 @@
+#!/bin/sh
+# mirror at another offset must end up holding the same filesystem
+
+set -e
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+lib=$(cd "$(dirname "$0")/.." && pwd)/fawrap.so
+seg=$dir/disk.img,1048576,33554944
+
+truncate -s 40M "$dir/disk.img"
+FILE=$seg,mirror=$dir/copy.img@0 LD_PRELOAD=$lib mke2fs -q -F -t ext4 "$dir/disk.img"
+test "$(stat -c %s "$dir/copy.img")" -eq 33554944
+dd if="$dir/disk.img" bs=512 skip=2048 count=65537 status=none | cmp - "$dir/copy.img"
+
+FILE=$dir/copy.img,0,33554944 LD_PRELOAD=$lib e2fsck -fn "$dir/copy.img" > /dev/null 2>&1
+echo "mirror: ok"
@@ -0,0 +1,20 @@
+#!/bin/sh
+# image shorter than the segment keeps its size while only read and
+# is extended and mapped when the filesystem is written
+
+set -e
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+lib=$(cd "$(dirname "$0")/.." && pwd)/fawrap.so
+seg=$dir/disk.img,1048576,33554944
+
+truncate -s 8M "$dir/disk.img"
+FILE=$seg,mmap LD_PRELOAD=$lib dumpe2fs -h "$dir/disk.img" > /dev/null 2>&1 || true
+test "$(stat -c %s "$dir/disk.img")" -eq 8388608
+
+FILE=$seg,mmap LD_PRELOAD=$lib mke2fs -q -F -t ext4 "$dir/disk.img"
+test "$(stat -c %s "$dir/disk.img")" -eq 34603520
+
+FILE=$seg,mmap LD_PRELOAD=$lib e2fsck -fn "$dir/disk.img" > /dev/null 2>&1
+FILE=$seg LD_PRELOAD=$lib e2fsck -fn "$dir/disk.img" > /dev/null 2>&1
+echo "mmap: ok"
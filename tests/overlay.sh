@@ -0,0 +1,20 @@
+#!/bin/sh
+# filesystem made through an overlay leaves the base image untouched
+# until the delta is committed
+
+set -e
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+lib=$(cd "$(dirname "$0")/.." && pwd)/fawrap.so
+seg=$dir/disk.img,1048576,33554944
+
+truncate -s 40M "$dir/disk.img"
+FILE=$seg,overlay=$dir/try.delta LD_PRELOAD=$lib mke2fs -q -F -t ext4 "$dir/disk.img"
+cmp -s -n 41943040 "$dir/disk.img" /dev/zero
+
+FILE=$seg,overlay=$dir/try.delta LD_PRELOAD=$lib e2fsck -fn "$dir/disk.img" > /dev/null 2>&1
+FILE=$seg,overlay=$dir/try.delta,commit LD_PRELOAD=$lib e2fsck -fn "$dir/disk.img" > /dev/null 2>&1
+test ! -e "$dir/try.delta"
+
+FILE=$seg LD_PRELOAD=$lib e2fsck -fn "$dir/disk.img" > /dev/null 2>&1
+echo "overlay: ok"
@@ -0,0 +1,43 @@
+#!/bin/sh
+# filesystem made in a new qcow2 image: clusters are allocated as it
+# is written and read back through the cluster tables
+
+set -e
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+lib=$(cd "$(dirname "$0")/.." && pwd)/fawrap.so
+seg=$dir/vm.qcow2,1048576,0
+
+# big endian value of $1 bytes written at offset $2
+put() {
+  n=$1 v=$3 s=
+  while [ "$n" -gt 0 ]; do
+    s=$(printf '\\%03o' $((v & 255)))$s
+    v=$((v >> 8)) n=$((n - 1))
+  done
+  printf "$s" | dd of="$dir/vm.qcow2" bs=1 seek="$2" conv=notrunc status=none
+}
+
+# version 2, 64K clusters, 40M guest disk: header, L1 table,
+# refcount table and one refcount block for these 4 clusters
+truncate -s 256K "$dir/vm.qcow2"
+put 4 0 0x514649fb
+put 4 4 2
+put 4 20 16
+put 8 24 41943040
+put 4 36 1
+put 8 40 65536
+put 8 48 131072
+put 4 56 1
+put 8 131072 196608
+for i in 0 1 2 3; do
+  put 2 $((196608 + i * 2)) 1
+done
+
+FILE=$seg LD_PRELOAD=$lib mke2fs -q -F -t ext4 "$dir/vm.qcow2"
+test "$(stat -c %s "$dir/vm.qcow2")" -lt 41943040
+
+FILE=$seg LD_PRELOAD=$lib e2fsck -fn "$dir/vm.qcow2" > /dev/null 2>&1
+FILE=$seg LD_PRELOAD=$lib dumpe2fs -h "$dir/vm.qcow2" 2>/dev/null | \
+  grep -q "^Block count: *39936$"
+echo "qcow2: ok"
@@ -0,0 +1,16 @@
+#!/bin/sh
+# segment built in memory and written back at exit, then checked
+# through ram and directly
+
+set -e
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+lib=$(cd "$(dirname "$0")/.." && pwd)/fawrap.so
+seg=$dir/disk.img,1048576,33554944
+
+truncate -s 40M "$dir/disk.img"
+FILE=$seg,ram LD_PRELOAD=$lib mke2fs -q -F -t ext4 "$dir/disk.img"
+
+FILE=$seg,ram LD_PRELOAD=$lib e2fsck -fn "$dir/disk.img" > /dev/null 2>&1
+FILE=$seg LD_PRELOAD=$lib e2fsck -fn "$dir/disk.img" > /dev/null 2>&1
+echo "ram: ok"
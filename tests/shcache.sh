@@ -0,0 +1,17 @@
+#!/bin/sh
+# block 0 (ext superblock) read through a freshly started cache daemon
+# must come from the image, not from an empty slot
+
+set -e
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+lib=$(cd "$(dirname "$0")/.." && pwd)/fawrap.so
+seg=$dir/disk.img,1048576,33554944
+
+truncate -s 40M "$dir/disk.img"
+FILE=$seg LD_PRELOAD=$lib mke2fs -q -F -t ext4 "$dir/disk.img"
+
+# new image, so its own daemon is started for it
+FILE=$seg,shcache=4M:5 LD_PRELOAD=$lib e2fsck -fn "$dir/disk.img" > /dev/null 2>&1
+FILE=$seg,shcache=4M:5 LD_PRELOAD=$lib e2fsck -fn "$dir/disk.img" > /dev/null 2>&1
+echo "shcache: ok"
@@ -0,0 +1,25 @@
+#!/bin/sh
+# zero blocks of a fully allocated image become holes, contents and
+# filesystem stay the same; dry run changes nothing
+
+set -e
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+top=$(cd "$(dirname "$0")/.." && pwd)
+lib=$top/fawrap.so
+seg=$dir/disk.img,1048576,33554944
+
+dd if=/dev/zero of="$dir/disk.img" bs=1M count=40 status=none
+FILE=$seg LD_PRELOAD=$lib mke2fs -q -F -t ext4 -E nodiscard "$dir/disk.img"
+sum=$(md5sum < "$dir/disk.img")
+used=$(du -k "$dir/disk.img" | cut -f 1)
+
+"$top/fawrap-sparsify" -n "$seg" > /dev/null
+test "$(du -k "$dir/disk.img" | cut -f 1)" -eq "$used"
+
+"$top/fawrap-sparsify" "$seg" > /dev/null
+test "$(du -k "$dir/disk.img" | cut -f 1)" -lt $((used - 16384))
+test "$(md5sum < "$dir/disk.img")" = "$sum"
+
+FILE=$seg LD_PRELOAD=$lib e2fsck -fn "$dir/disk.img" > /dev/null 2>&1
+echo "sparsify: ok"
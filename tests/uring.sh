@@ -0,0 +1,16 @@
+#!/bin/sh
+# writes queued on io_uring and reaped at flush points must all
+# reach the image
+
+set -e
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+lib=$(cd "$(dirname "$0")/.." && pwd)/fawrap.so
+seg=$dir/disk.img,1048576,33554944
+
+truncate -s 40M "$dir/disk.img"
+FILE=$seg,uring LD_PRELOAD=$lib mke2fs -q -F -t ext4 "$dir/disk.img"
+
+FILE=$seg,uring LD_PRELOAD=$lib e2fsck -fn "$dir/disk.img" > /dev/null 2>&1
+FILE=$seg LD_PRELOAD=$lib e2fsck -fn "$dir/disk.img" > /dev/null 2>&1
+echo "uring: ok"
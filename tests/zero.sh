@@ -0,0 +1,17 @@
+#!/bin/sh
+# zero mode creates the image sparse and answers reads of blocks never
+# written from memory; the filesystem must check clean without it
+
+set -e
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+lib=$(cd "$(dirname "$0")/.." && pwd)/fawrap.so
+seg=$dir/disk.img,1048576,33554944
+
+FILE=$seg,zero LD_PRELOAD=$lib mke2fs -q -F -t ext4 "$dir/disk.img"
+test "$(stat -c %s "$dir/disk.img")" -eq 34603520
+test "$(du -k "$dir/disk.img" | cut -f 1)" -lt 16384
+
+FILE=$seg,zero LD_PRELOAD=$lib e2fsck -fn "$dir/disk.img" > /dev/null 2>&1
+FILE=$seg LD_PRELOAD=$lib e2fsck -fn "$dir/disk.img" > /dev/null 2>&1
+echo "zero: ok"
@@ -0,0 +1,18 @@
+#!/bin/sh
+# filesystem read back from a seekable zstd copy of its segment
+
+set -e
+/sbin/ldconfig -p | grep -q libzstd.so.1 || { echo "zstd: skipped, no libzstd"; exit 0; }
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+lib=$(cd "$(dirname "$0")/.." && pwd)/fawrap.so
+seg=$dir/disk.img,1048576,33554944
+
+truncate -s 40M "$dir/disk.img"
+FILE=$seg LD_PRELOAD=$lib mke2fs -q -F -t ext4 "$dir/disk.img"
+FILE=$seg,export=$dir/disk.img.zst LD_PRELOAD=$lib e2fsck -fn "$dir/disk.img" > /dev/null 2>&1
+
+FILE=$dir/disk.img.zst,0,0 LD_PRELOAD=$lib e2fsck -fn "$dir/disk.img.zst" > /dev/null 2>&1
+FILE=$dir/disk.img.zst,0,0 LD_PRELOAD=$lib dumpe2fs -h "$dir/disk.img.zst" 2>/dev/null | \
+  grep -q "^Block count: *32768$"
+echo "zstd: ok"